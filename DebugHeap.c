@@ -27,12 +27,25 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "DebugHeap.h"
 #include <stdint.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #if defined(_WIN32)
 #include <Windows.h>
+#include <intrin.h>
 #elif defined(__APPLE__) || defined(linux)
+#include <errno.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#if defined(linux)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 #else
 # error What are you?!
 #endif
@@ -45,12 +58,68 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define ASSERT_FATAL(expr, message, ...) \
   assert(expr && message)
 
+// Memory errors found by checking fill patterns and canaries, and system
+// calls that fail for good, are fatal even when asserts are compiled out.
+// The message is printed before the program is aborted.
+// Substitute your own error handler.
+#define CHECK_FATAL(expr, ...) \
+  do { if (!(expr)) FatalError(__VA_ARGS__); } while (0)
+
+static void FatalError(const char* format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+  abort();
+}
+
+// Define DEBUG_HEAP_LINEAR_FREELIST to 1 to go back to a single unordered free
+// list that is scanned linearly for the best fit. This is only useful for A/B
+// comparisons against the size-binned free list.
+#if !defined(DEBUG_HEAP_LINEAR_FREELIST)
+#define DEBUG_HEAP_LINEAR_FREELIST 0
+#endif
+
+// Pattern fills and checks use SSE2 on targets where every CPU has it, and
+// checks use AVX2 if the CPU turns out to have it. Define DEBUG_HEAP_SSE2 to
+// 0 to use plain C instead.
+#if !defined(DEBUG_HEAP_SSE2)
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define DEBUG_HEAP_SSE2 1
+#else
+#define DEBUG_HEAP_SSE2 0
+#endif
+#endif
+
+#if DEBUG_HEAP_SSE2
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#define DEBUG_HEAP_TARGET_AVX2
+#else
+#define DEBUG_HEAP_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
 // Routines that wrap platform-specific virtual memory functionality.
 
 static void* VmAllocate(size_t size);
 static void VmFree(void* ptr, size_t size);
 static void VmCommit(void* ptr, size_t size);
 static void VmDecommit(void* ptr, size_t size);
+static void VmProtectNone(void* ptr, size_t size);
+static uint32_t VmMappingLimit(void);
+static int VmGuardSupported(void);
+static void VmGuardInstall(void* ptr, size_t size);
+static void VmGuardRemove(void* ptr, size_t size);
+static int VmBatchOpen(void);
+static void VmBatchClose(int handle);
+static int VmGuardInstallBatch(int handle, char* const* bases, const size_t* sizes, uint32_t count);
+
+// The worker thread's entry point, see ThreadStart().
+static void WorkerMain(void* arg);
 
 // Windows virtual memory support.
 #if defined(_WIN32)
@@ -58,9 +127,8 @@ typedef volatile LONG DebugHeapAtomicType;
 
 static void* VmAllocate(size_t size)
 {
-  void* result = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_READWRITE);
-  ASSERT_FATAL(result, "Couldn't allocate address space");
-  return result;
+  // Returns NULL when out of address space, so the heap can fail gracefully.
+  return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_READWRITE);
 }
 
 static void VmFree(void* ptr, size_t size)
@@ -82,6 +150,25 @@ static void VmDecommit(void* ptr, size_t size)
   ASSERT_FATAL(result, "Failed to decommit memory");
 }
 
+// Make committed pages inaccessible, but keep them.
+static void VmProtectNone(void* ptr, size_t size)
+{
+  DWORD old_protect;
+  CHECK_FATAL(VirtualProtect(ptr, size, PAGE_NOACCESS, &old_protect), "Failed to protect memory");
+}
+
+// Windows has no fixed cap on the number of memory mappings.
+static uint32_t VmMappingLimit(void)
+{
+  return 0;
+}
+
+// Millisecond timestamp for aging freed blocks. Wraps every ~49 days.
+static uint32_t TimeNowMs(void)
+{
+  return (uint32_t) GetTickCount();
+}
+
 static DebugHeapAtomicType AtomicInc32(DebugHeapAtomicType *var)
 {
   return InterlockedIncrement(var);
@@ -91,499 +178,4112 @@ static DebugHeapAtomicType AtomicDec32(DebugHeapAtomicType *var)
 {
   return InterlockedDecrement(var);
 }
-#endif
 
-#if defined(__APPLE__) || defined(linux)
-typedef volatile uint32_t DebugHeapAtomicType;
-
-static void* VmAllocate(size_t size)
+static uint32_t AtomicLoad32(DebugHeapAtomicType *var)
 {
-  void* result = mmap(NULL, size, PROT_NONE, MAP_ANON|MAP_PRIVATE, -1, 0);
-  ASSERT_FATAL(result, "Couldn't allocate address space");
-  return result;
+  return (uint32_t) InterlockedCompareExchange(var, 0, 0);
 }
 
-static void VmFree(void* ptr, size_t size)
+// Returns the new value.
+static uint32_t AtomicAdd32(DebugHeapAtomicType *var, int32_t value)
 {
-  int result = munmap(ptr, size);
-  ASSERT_FATAL(0 == result, "Failed to free memory");
+  return (uint32_t) (InterlockedExchangeAdd(var, value) + value);
 }
 
-static void VmCommit(void* ptr, size_t size)
+static void AtomicStore32(DebugHeapAtomicType *var, uint32_t value)
 {
-  int result = mprotect(ptr, size, PROT_READ|PROT_WRITE);
-  ASSERT_FATAL(0 == result, "Failed to commit memory");
+  InterlockedExchange(var, (LONG) value);
 }
 
-static void VmDecommit(void* ptr, size_t size)
+// Threads and locking for the worker thread.
+typedef CRITICAL_SECTION   DebugHeapMutex;
+typedef CONDITION_VARIABLE DebugHeapCond;
+typedef HANDLE             DebugHeapThread;
+
+static void MutexInit(DebugHeapMutex* mutex)
 {
-  int result = madvise(ptr, size, MADV_DONTNEED);
-  ASSERT_FATAL(0 == result, "madvise() failed");
-  result = mprotect(ptr, size, PROT_NONE);
-  ASSERT_FATAL(0 == result, "Failed to decommit memory");
+  InitializeCriticalSection(mutex);
 }
 
-static DebugHeapAtomicType AtomicInc32(DebugHeapAtomicType *var)
+static void MutexDestroy(DebugHeapMutex* mutex)
 {
-  return __sync_add_and_fetch(var, 1);
+  DeleteCriticalSection(mutex);
 }
 
-static DebugHeapAtomicType AtomicDec32(DebugHeapAtomicType *var)
+static void MutexLock(DebugHeapMutex* mutex)
 {
-  return __sync_sub_and_fetch(var, 1);
+  EnterCriticalSection(mutex);
 }
-#endif
 
-
-// We want to use the smallest page size possible, and that happens to be 4k on x86/x64.
-// Using larger pages sizes would waste enormous amounts of memory.
-enum
+static void MutexUnlock(DebugHeapMutex* mutex)
 {
-  kPageSize       = 4096,
-};
+  LeaveCriticalSection(mutex);
+}
 
-typedef struct DebugBlockInfo
+static void CondInit(DebugHeapCond* cond)
 {
-  uint32_t               m_Allocated    : 1;
-  uint32_t               m_PageCount    : 31;
-  uint32_t               m_PendingFree  : 1;
-  uint32_t               m_PageIndex    : 31;
-  struct DebugBlockInfo *m_Prev;
-  struct DebugBlockInfo *m_Next;
-} DebugBlockInfo;
+  InitializeConditionVariable(cond);
+}
 
-struct DebugHeap
+static void CondDestroy(DebugHeapCond* cond)
 {
-  uint32_t         m_MaxAllocs;
-  uint32_t         m_PageCount;
-
-  char*            m_BaseAddress;
+  (void) cond;
+}
 
-  uint32_t         m_FreeListSize;
-  DebugBlockInfo** m_FreeList;
+static void CondWait(DebugHeapCond* cond, DebugHeapMutex* mutex)
+{
+  SleepConditionVariableCS(cond, mutex, INFINITE);
+}
 
-  uint32_t         m_PendingListSize;
-  DebugBlockInfo** m_PendingList;
+static void CondBroadcast(DebugHeapCond* cond)
+{
+  WakeAllConditionVariable(cond);
+}
 
-  DebugBlockInfo** m_BlockLookup;
-  DebugBlockInfo*  m_FirstUnusedBlockInfo;
+static DWORD WINAPI ThreadEntry(LPVOID arg)
+{
+  WorkerMain(arg);
+  return 0;
+}
 
-  DebugBlockInfo*  m_Blocks;
+// Start a thread running WorkerMain(arg). Returns zero on failure.
+static int ThreadStart(DebugHeapThread* thread, void* arg)
+{
+  *thread = CreateThread(NULL, 0, ThreadEntry, arg, 0, NULL);
+  return NULL != *thread;
+}
 
-  DebugHeapAtomicType m_ReentrancyGuard;
-};
+static void ThreadJoin(DebugHeapThread thread)
+{
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
 
-#define DEBUG_THREAD_GUARD_ENTER(heap) \
-  ASSERT_FATAL(1 == AtomicInc32(&heap->m_ReentrancyGuard), "Unsynchronized MT usage detected")
+// Bit scans. The input must be non-zero.
+static uint32_t CountLeadingZeros64(uint64_t value)
+{
+  unsigned long index;
+  _BitScanReverse64(&index, value);
+  return 63 - (uint32_t) index;
+}
 
-#define DEBUG_THREAD_GUARD_LEAVE(heap) \
-  ASSERT_FATAL(0 == AtomicDec32(&heap->m_ReentrancyGuard), "Unsynchronized MT usage detected")
+static uint32_t CountTrailingZeros64(uint64_t value)
+{
+  unsigned long index;
+  _BitScanForward64(&index, value);
+  return (uint32_t) index;
+}
 
-static void* AdvancePtr(void* src, size_t amount)
+static uint32_t PopCount64(uint64_t value)
 {
-  return (char*)src + amount;
+  return (uint32_t) __popcnt64(value);
 }
 
-DebugBlockInfo* AllocBlockInfo(DebugHeap* heap)
+#if DEBUG_HEAP_SSE2
+static int CpuHasAvx2(void)
 {
-  DebugBlockInfo* result = heap->m_FirstUnusedBlockInfo;
-  ASSERT_FATAL((uint32_t)result->m_Allocated, "Block info corrupted");
-  ASSERT_FATAL((uint32_t)result->m_PendingFree, "Block info corrupted");
-  heap->m_FirstUnusedBlockInfo = result->m_Next;
+  int info[4];
 
-  memset(result, 0, sizeof *result);
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return 0;
 
-  return result;
+  // The OS must save the upper halves of the registers too.
+  __cpuid(info, 1);
+  if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || 6 != (_xgetbv(0) & 6))
+    return 0;
+
+  __cpuidex(info, 7, 0);
+  return (info[1] >> 5) & 1;
 }
+#endif
+#endif
 
-void FreeBlockInfo(DebugHeap* heap, DebugBlockInfo* block_info)
+#if defined(__APPLE__) || defined(linux)
+typedef volatile uint32_t DebugHeapAtomicType;
+
+static void* VmAllocate(size_t size)
 {
-  block_info->m_Allocated = 1;
-  block_info->m_PendingFree = 1;
-  block_info->m_Prev = NULL;
-  block_info->m_Next = heap->m_FirstUnusedBlockInfo;
-  heap->m_FirstUnusedBlockInfo = block_info;
+  // Returns NULL when out of address space, so the heap can fail gracefully.
+  // Without MAP_NORESERVE, Linux flags ranges for commit accounting when they
+  // are made writable, and they never merge with untouched neighbors again.
+  void* result = mmap(NULL, size, PROT_NONE, MAP_ANON|MAP_PRIVATE|MAP_NORESERVE, -1, 0);
+  return MAP_FAILED == result ? NULL : result;
 }
 
-DebugHeap* DebugHeapInit(size_t mem_size_bytes)
+static void VmFree(void* ptr, size_t size)
 {
-  DebugHeap* self;
-
-  const size_t mem_page_count    = mem_size_bytes / kPageSize;
-  const size_t max_allocs        = mem_page_count / 2;
+  int result = munmap(ptr, size);
+  ASSERT_FATAL(0 == result, "Failed to free memory");
+}
 
-  const size_t bookkeeping_bytes =
-    sizeof(DebugHeap) +
-    (3 * mem_page_count * sizeof(DebugBlockInfo*)) +
-    sizeof(DebugBlockInfo) * mem_page_count;
+static void VmCommit(void* ptr, size_t size)
+{
+  int result = mprotect(ptr, size, PROT_READ|PROT_WRITE);
+  ASSERT_FATAL(0 == result, "Failed to commit memory");
+}
 
-  const size_t bookkeeping_pages = (bookkeeping_bytes + kPageSize - 1) / kPageSize;
-  const size_t total_pages       = bookkeeping_pages + mem_page_count;
-  const size_t total_bytes       = total_pages * kPageSize;
+static void VmDecommit(void* ptr, size_t size)
+{
+#if defined(linux)
+  // Map fresh inaccessible memory over the range. That drops the pages just
+  // like MADV_DONTNEED, but the new mapping has no anonymous memory attached,
+  // so the kernel merges it with its inaccessible neighbors. A range that was
+  // only mprotect()ed stays a mapping of its own until it's reused.
+  // A failure here would leave the pages accessible, so check it even in
+  // release builds.
+  CHECK_FATAL(ptr == mmap(ptr, size, PROT_NONE, MAP_ANON|MAP_PRIVATE|MAP_NORESERVE|MAP_FIXED, -1, 0),
+      "Failed to decommit memory (errno %d)", errno);
+#else
+  int result = madvise(ptr, size, MADV_DONTNEED);
+  ASSERT_FATAL(0 == result, "madvise() failed");
+  result = mprotect(ptr, size, PROT_NONE);
+  ASSERT_FATAL(0 == result, "Failed to decommit memory");
+#endif
+}
 
-  char* range = (char *)VmAllocate(total_bytes);
-  if (!range)
-  {
-    return NULL;
-  }
+// Make committed pages inaccessible, but keep them.
+static void VmProtectNone(void* ptr, size_t size)
+{
+  CHECK_FATAL(0 == mprotect(ptr, size, PROT_NONE), "Failed to protect memory (errno %d)", errno);
+}
 
-  VmCommit(range, bookkeeping_pages * kPageSize);
+#if defined(linux)
+// Linux caps the number of memory mappings per process at vm.max_map_count,
+// and mprotect() fails past that. Return how many the heap can have, leaving
+// what the process uses already plus some slack for whatever it maps later.
+static uint32_t VmMappingLimit(void)
+{
+  char buffer[4096];
+  uint32_t limit = 0, used = 0;
+  ssize_t i, count;
+  int fd;
 
-  self = (DebugHeap*) range;
+  if ((fd = open("/proc/sys/vm/max_map_count", O_RDONLY)) < 0)
+    return 0;
+  count = read(fd, buffer, sizeof buffer);
+  close(fd);
+  for (i = 0; i < count && buffer[i] >= '0' && buffer[i] <= '9'; ++i)
+    limit = limit * 10 + (buffer[i] - '0');
 
-  self->m_MaxAllocs       = (uint32_t) max_allocs;
-  self->m_BaseAddress     = range + kPageSize * bookkeeping_pages;
-  self->m_PageCount       = (uint32_t) mem_page_count;
-  self->m_FreeList        = (DebugBlockInfo**) AdvancePtr(range, sizeof(DebugHeap));
-  self->m_PendingList     = (DebugBlockInfo**) AdvancePtr(self->m_FreeList,     sizeof(DebugBlockInfo*) * mem_page_count);
-  self->m_BlockLookup     = (DebugBlockInfo**) AdvancePtr(self->m_PendingList,  sizeof(DebugBlockInfo*) * mem_page_count);
-  self->m_Blocks          = (DebugBlockInfo*)  AdvancePtr(self->m_BlockLookup,  sizeof(DebugBlockInfo*) * mem_page_count);
-  self->m_FreeListSize    = 1;
-  self->m_PendingListSize = 0;
-  self->m_ReentrancyGuard = 0;
+  if (0 == limit)
+    return 0;
 
-  // Initialize block allocation linked list
+  if ((fd = open("/proc/self/maps", O_RDONLY)) >= 0)
   {
-    uint32_t i, count;
-    for (i = 0, count = self->m_MaxAllocs; i < count; ++i)
+    while ((count = read(fd, buffer, sizeof buffer)) > 0)
     {
-      self->m_Blocks[i].m_Allocated = 1;        // flag invalid
-      self->m_Blocks[i].m_PendingFree = 1;      // flag invalid
-      self->m_Blocks[i].m_Prev = NULL;
-      self->m_Blocks[i].m_Next = (i + 1) < count ? &self->m_Blocks[i+1] : NULL;
+      for (i = 0; i < count; ++i)
+        used += '\n' == buffer[i];
     }
+    close(fd);
   }
 
-  self->m_FirstUnusedBlockInfo = &self->m_Blocks[0];
+  used += limit / 16;
+  return limit > used ? limit - used : 1;
+}
+#else
+static uint32_t VmMappingLimit(void)
+{
+  return 0;
+}
+#endif
 
-  {
-    DebugBlockInfo* root_block = AllocBlockInfo(self);
+#if defined(linux)
+#if !defined(MADV_GUARD_INSTALL)
+#define MADV_GUARD_INSTALL 102
+#define MADV_GUARD_REMOVE  103
+#endif
 
-    root_block->m_PageIndex = 0;
-    root_block->m_Allocated = 0;
-    root_block->m_PendingFree = 0;
-    root_block->m_PageCount = (uint32_t) mem_page_count;
-    root_block->m_Prev = NULL;
-    root_block->m_Next = NULL;
+// Lightweight guard regions (Linux 6.13+). Touching a page with a guard
+// marker faults just like PROT_NONE, but the markers live in the page
+// tables, so they don't split mappings or take the mmap write lock.
+static int VmGuardSupported(void)
+{
+  int result;
+  void* probe = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
 
-    self->m_FreeList[0] = root_block;
-  }
+  if (MAP_FAILED == probe)
+    return 0;
 
-  return self;
+  result = madvise(probe, 4096, MADV_GUARD_INSTALL);
+  munmap(probe, 4096);
+  return 0 == result;
 }
 
-void DebugHeapDestroy(DebugHeap* heap)
+// Installing markers also drops any pages in the range.
+static void VmGuardInstall(void* ptr, size_t size)
 {
-  VmFree(heap, heap->m_PageCount * kPageSize);
+  // Retry only on transient errors; anything else would fail forever.
+  while (0 != madvise(ptr, size, MADV_GUARD_INSTALL))
+  {
+    CHECK_FATAL(EINTR == errno || EAGAIN == errno, "Failed to install guard region (errno %d)", errno);
+  }
 }
 
-static void* AllocFromFreeList(DebugHeap* heap, size_t page_req)
+static void VmGuardRemove(void* ptr, size_t size)
 {
-  // Cache in register to avoid repeated memory derefs
-  DebugBlockInfo** const free_list = heap->m_FreeList;
+  CHECK_FATAL(0 == madvise(ptr, size, MADV_GUARD_REMOVE), "Failed to remove guard region (errno %d)", errno);
+}
 
-  // Keep track of the best fitting block so far.
-  DebugBlockInfo* best_block = NULL;
-  uint32_t best_block_size = ~0u;
-  uint32_t best_freelist_index = 0;
-  uint32_t i, count;
+#if !defined(SYS_pidfd_open)
+#define SYS_pidfd_open 434
+#endif
+#if !defined(SYS_process_madvise)
+#define SYS_process_madvise 440
+#endif
 
-  // First try the free list. This is slow. That's OK. It's a debug heap.
-  for (i = 0, count = heap->m_FreeListSize; i < count; ++i)
-  {
-    DebugBlockInfo* block = free_list[i];
-    uint32_t block_count = block->m_PageCount;
-    ASSERT_FATAL(!block->m_Allocated, "block info corrupted");
-    ASSERT_FATAL(!block->m_PendingFree, "block info corrupted");
+// process_madvise() installs guard regions over a whole vector of ranges in
+// one call. It needs a pidfd for our own process, and only accepts
+// MADV_GUARD_INSTALL since Linux 6.13.
+static int VmBatchOpen(void)
+{
+  return (int) syscall(SYS_pidfd_open, getpid(), 0);
+}
 
-    if (block_count >= page_req && block_count < best_block_size)
-    {
-      best_block = block;
-      best_block_size = block_count;
-      best_freelist_index = i;
-    }
-  }
+static void VmBatchClose(int handle)
+{
+  if (handle >= 0)
+    close(handle);
+}
 
-  if (!best_block)
-    return NULL;
+// Returns zero if the batch couldn't be done in one go. Installing guard
+// regions again is harmless, so the caller can just redo it range by range.
+static int VmGuardInstallBatch(int handle, char* const* bases, const size_t* sizes, uint32_t count)
+{
+  struct iovec ranges[64];
+  size_t total = 0;
+  uint32_t i;
+
+  if (count > sizeof ranges / sizeof ranges[0])
+    return 0;
 
-  // Take this block off the free list.
-  if (heap->m_FreeListSize > 1)
+  for (i = 0; i < count; ++i)
   {
-    heap->m_FreeList[best_freelist_index] = heap->m_FreeList[heap->m_FreeListSize - 1];
+    ranges[i].iov_base = bases[i];
+    ranges[i].iov_len = sizes[i];
+    total += sizes[i];
   }
-  heap->m_FreeListSize--;
 
-  // Carve out the number of pages we need from our best block.
-  {
-    uint32_t unused_page_count = (uint32_t) (best_block_size - page_req);
+  return (long) total == syscall(SYS_process_madvise, handle, ranges, (size_t) count, MADV_GUARD_INSTALL, 0u);
+}
+#endif
 
-    if (unused_page_count > 0)
-    {
-      // Allocate a new block to keep track of the tail end.
-      DebugBlockInfo* tail_block = AllocBlockInfo(heap);
-      tail_block->m_Allocated = 0;
-      tail_block->m_PendingFree = 0;
-      tail_block->m_PageIndex = best_block->m_PageIndex + best_block->m_PageCount - unused_page_count;
-      tail_block->m_PageCount = unused_page_count;
+// Millisecond timestamp for aging freed blocks. Wraps every ~49 days.
+static uint32_t TimeNowMs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t) ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
 
-      // Link it in to the chain.
-      tail_block->m_Next = best_block->m_Next;
-      tail_block->m_Prev = best_block;
-      best_block->m_Next = tail_block;
+static DebugHeapAtomicType AtomicInc32(DebugHeapAtomicType *var)
+{
+  return __sync_add_and_fetch(var, 1);
+}
 
-      // Add it to the free list
-      heap->m_FreeList[heap->m_FreeListSize++] = tail_block;
+static DebugHeapAtomicType AtomicDec32(DebugHeapAtomicType *var)
+{
+  return __sync_sub_and_fetch(var, 1);
+}
 
-      // Patch up this block
-      best_block->m_PageCount = (uint32_t) page_req;
-    }
-  }
+static uint32_t AtomicLoad32(DebugHeapAtomicType *var)
+{
+  return __atomic_load_n(var, __ATOMIC_ACQUIRE);
+}
 
-  best_block->m_Allocated = 1;
+// Returns the new value.
+static uint32_t AtomicAdd32(DebugHeapAtomicType *var, int32_t value)
+{
+  return __sync_add_and_fetch(var, (uint32_t) value);
+}
 
-  ASSERT_FATAL(heap->m_BlockLookup[best_block->m_PageIndex] == NULL, "block lookup corrupted");
-  heap->m_BlockLookup[best_block->m_PageIndex] = best_block;
+static void AtomicStore32(DebugHeapAtomicType *var, uint32_t value)
+{
+  __atomic_store_n(var, value, __ATOMIC_RELEASE);
+}
 
-  {
-    uint32_t i, max;
-    for (i = 1, max = best_block->m_PageCount; i < max; ++i)
-    {
-      ASSERT_FATAL(heap->m_BlockLookup[best_block->m_PageIndex + i] == NULL, "block lookup corrupted");
-    }
-  }
+// Threads and locking for the worker thread.
+typedef pthread_mutex_t DebugHeapMutex;
+typedef pthread_cond_t  DebugHeapCond;
+typedef pthread_t       DebugHeapThread;
 
-  return heap->m_BaseAddress + ((uint64_t)(best_block->m_PageIndex)) * kPageSize;
+static void MutexInit(DebugHeapMutex* mutex)
+{
+  pthread_mutex_init(mutex, NULL);
 }
 
-static void* FinalizeAlloc(void* ptr_in, size_t user_size, size_t pages_allocated, size_t user_alignment)
+static void MutexDestroy(DebugHeapMutex* mutex)
 {
-  char* ptr = (char*) ptr_in;
-  uint32_t ideal_offset, aligned_offset;
-
-  // Commit pages in user-accessible section.
-  VmCommit(ptr, (pages_allocated - 1) * kPageSize);
+  pthread_mutex_destroy(mutex);
+}
 
-  // Decommit guard page to force crashes for stepping over bounds
-  VmDecommit(ptr + (pages_allocated - 1) * kPageSize, kPageSize);
+static void MutexLock(DebugHeapMutex* mutex)
+{
+  pthread_mutex_lock(mutex);
+}
 
-  // Align user allocation towards end of page, respecting user alignment.
+static void MutexUnlock(DebugHeapMutex* mutex)
+{
+  pthread_mutex_unlock(mutex);
+}
 
-  // Ideally the offset would be kPageSize - user_size % kPageSize.
-  ideal_offset = ((uint32_t)(kPageSize - user_size)) % kPageSize;
+static void CondInit(DebugHeapCond* cond)
+{
+  pthread_cond_init(cond, NULL);
+}
 
-  // Align down to meet user minimum alignment.
-  aligned_offset = ideal_offset & ~((uint32_t)(user_alignment-1));
+static void CondDestroy(DebugHeapCond* cond)
+{
+  pthread_cond_destroy(cond);
+}
 
-  // Garbage fill start of page.
-  memset(ptr, 0xfc, aligned_offset);
+static void CondWait(DebugHeapCond* cond, DebugHeapMutex* mutex)
+{
+  pthread_cond_wait(cond, mutex);
+}
 
-  return ptr + aligned_offset;
+static void CondBroadcast(DebugHeapCond* cond)
+{
+  pthread_cond_broadcast(cond);
 }
 
-static void FlushPendingFrees(DebugHeap* heap)
+static void* ThreadEntry(void* arg)
 {
-  uint32_t i, count;
-  for (i = 0, count = heap->m_PendingListSize; i < count; ++i)
-  {
-    int block_removed = 0;
+  WorkerMain(arg);
+  return NULL;
+}
 
-    DebugBlockInfo* block = heap->m_PendingList[i];
-    DebugBlockInfo* prev;
-    DebugBlockInfo* next;
+// Start a thread running WorkerMain(arg). Returns zero on failure.
+static int ThreadStart(DebugHeapThread* thread, void* arg)
+{
+  return 0 == pthread_create(thread, NULL, ThreadEntry, arg);
+}
 
-    // Attempt to merge into an adjacent block to the left.
-    // We can only merge with blocks that are free and not on this same pending list.
-    if (NULL != (prev = block->m_Prev))
-    {
-      if (!prev->m_Allocated && !prev->m_PendingFree && prev->m_PageIndex + prev->m_PageCount == block->m_PageIndex)
-      {
-        // Linked list setup.
-        prev->m_Next = block->m_Next;
+static void ThreadJoin(DebugHeapThread thread)
+{
+  pthread_join(thread, NULL);
+}
 
-        if (block->m_Next)
-          block->m_Next->m_Prev = prev;
+// Bit scans. The input must be non-zero.
+static uint32_t CountLeadingZeros64(uint64_t value)
+{
+  return (uint32_t) __builtin_clzll(value);
+}
 
-        // Increase size of left neighbor.
-        prev->m_PageCount += block->m_PageCount;
+static uint32_t CountTrailingZeros64(uint64_t value)
+{
+  return (uint32_t) __builtin_ctzll(value);
+}
 
-        // Kill this pending block.
-        FreeBlockInfo(heap, block);
+static uint32_t PopCount64(uint64_t value)
+{
+  return (uint32_t) __builtin_popcountll(value);
+}
+
+#if DEBUG_HEAP_SSE2
+static int CpuHasAvx2(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+#endif
+
+#if !defined(linux)
+// Guard regions are Linux only.
+static int VmGuardSupported(void)
+{
+  return 0;
+}
+
+static void VmGuardInstall(void* ptr, size_t size)
+{
+  ASSERT_FATAL(0, "Guard regions not supported");
+  (void) ptr; (void) size;
+}
+
+static void VmGuardRemove(void* ptr, size_t size)
+{
+  ASSERT_FATAL(0, "Guard regions not supported");
+  (void) ptr; (void) size;
+}
+
+static int VmBatchOpen(void)
+{
+  return -1;
+}
+
+static void VmBatchClose(int handle)
+{
+  (void) handle;
+}
+
+static int VmGuardInstallBatch(int handle, char* const* bases, const size_t* sizes, uint32_t count)
+{
+  (void) handle; (void) bases; (void) sizes; (void) count;
+  return 0;
+}
+#endif
+
+
+// We want to use the smallest page size possible, and that happens to be 4k on x86/x64.
+// Using larger pages sizes would waste enormous amounts of memory.
+enum
+{
+  kPageSize       = 4096,
+};
+
+// Free blocks are kept in size bins so the best fit can be found without
+// looking at every free block. Blocks smaller than kExactBinCount pages get a
+// bin per page count, so any block in them is an exact fit. Larger blocks are
+// binned by power of two, with each power split into 2^kSubBinBits sub-bins.
+enum
+{
+  kExactBinCount    = 64,
+  kExactBinLog2     = 6,
+  kSubBinBits       = 3,
+  kFreeBinCount     = kExactBinCount + (31 - kExactBinLog2) * (1 << kSubBinBits),
+  kFreeBinMaskWords = (kFreeBinCount + 63) / 64,
+};
+
+// Bookkeeping arrays are committed this many bytes at a time as they fill up.
+enum
+{
+  kBookkeepingCommitChunk = 16 * kPageSize,
+};
+
+// Each leaf of the block lookup is a page of block indices.
+enum
+{
+  kLookupLeafShift  = 10,
+  kLookupLeafPages  = 1 << kLookupLeafShift,
+};
+
+// Every live allocation splits its segment's mapping in two more places: a
+// read/write range for the user pages, followed by the inaccessible rest.
+// Freed and free pages are inaccessible too, so they merge back with their
+// neighbors. The bookkeeping reservation adds a handful of mappings as its
+// arrays are committed.
+enum
+{
+  kMappingsPerAlloc    = 2,
+  kBookkeepingMappings = 16,
+};
+
+// With guard regions, segments are made accessible and covered in guard
+// markers this many pages at a time, as placement first reaches them. One
+// chunk is one page table's worth on x64.
+enum
+{
+  kGuardPrepareChunk   = 512,
+};
+
+// Freed blocks can be decommitted in batches of up to this many ranges.
+enum
+{
+  kDecommitQueueSize   = 64,
+};
+
+// Ranges waiting for the worker. A power of two, so ring positions stay
+// consistent when tickets wrap.
+enum
+{
+  kWorkerQueueSize     = 256,
+};
+
+// What the worker does with a range.
+enum
+{
+  kWorkDecommit        = 0,
+  kWorkCommit          = 1,
+  kWorkGuardRemove     = 2,
+};
+
+// Freed blocks kept committed under the poison budget are filled with this.
+enum
+{
+  kPoisonByte          = 0xdd,
+};
+
+// With cache coloring, allocation starts are rotated through up to
+// kCacheColorMax lines of kCacheLineSize bytes, and the gap up to the guard
+// page is filled with kTailCanaryByte.
+enum
+{
+  kCacheLineSize       = 64,
+  kCacheColorMax       = kPageSize / kCacheLineSize,
+  kTailCanaryByte      = 0xfb,
+};
+
+// Paired blocks are a leading guard page, a page shared by two allocations
+// and a trailing guard page. Each allocation gets half of the shared page.
+enum
+{
+  kPairPageCount       = 3,
+  kPairHalfSize        = kPageSize / 2,
+  kPairLeft            = 1,
+  kPairRight           = 2,
+};
+
+// Packed pages hold tiny allocations in slots of kPackedGranule up to
+// kPackedMaxSize bytes, by size class. Every slot is followed by a canary
+// of kPackedGranule bytes, and the page starts with one.
+enum
+{
+  kPackedGranule       = 16,
+  kPackedClassCount    = 4,
+  kPackedMaxSize       = kPackedClassCount * kPackedGranule,
+  kPackedMaxSlots      = 128,
+  kSlotCanaryByte      = 0xfa,
+};
+
+// Fills of at least kStreamingFillSize bytes bypass the cache.
+enum
+{
+  kStreamingFillSize   = 64 * kPageSize,
+};
+
+// Ready slots are kept for allocations of 2 to kReadyPoolCount + 1 pages,
+// guard page included, up to kReadyPoolCapacity per size. Every
+// kReadyEpochLength allocations of those sizes, the slot budget is shared
+// out again by demand. Refills carve at most kReadyRefillPerCall slots per
+// call.
+enum
+{
+  kReadyPoolCount      = 16,
+  kReadyPoolCapacity   = 64,
+  kReadyEpochLength    = 1024,
+  kReadyRefillPerCall  = 2,
+};
+
+// The heap grows by adding segments, each a separate reservation. Every
+// segment gets a slot of at least kMinSlotShift bits of page index space, so
+// each slot's level 0 bitmap words fill whole pages. Segments are found from
+// addresses through a small hash table.
+enum
+{
+  kMaxSegments      = 64,
+  kMinSlotShift     = 15,
+  kSegmentHashBits  = 8,
+  kSegmentHashSize  = 1 << kSegmentHashBits,
+};
+
+// The bitmap engine keeps one bit per page, plus summary levels with one bit
+// per word of the level below. 31-bit page indices need at most six levels.
+enum
+{
+  kBitmapMaxLevels  = 6,
+};
+
+// The platform backend, used unless the config names another one.
+static void* PlatformVmAllocate(void* context, size_t size)
+{
+  return VmAllocate(size);
+}
+
+static void PlatformVmFree(void* context, void* ptr, size_t size)
+{
+  VmFree(ptr, size);
+}
+
+static void PlatformVmCommit(void* context, void* ptr, size_t size)
+{
+  VmCommit(ptr, size);
+}
+
+static void PlatformVmDecommit(void* context, void* ptr, size_t size)
+{
+  VmDecommit(ptr, size);
+}
+
+static const DebugHeapVmBackend s_PlatformVm =
+{
+  NULL,
+  PlatformVmAllocate,
+  PlatformVmFree,
+  PlatformVmCommit,
+  PlatformVmDecommit,
+};
+
+typedef struct DebugBlockInfo
+{
+  uint32_t               m_Allocated    : 1;
+  uint32_t               m_PageCount    : 31;
+  uint32_t               m_PendingFree  : 1;
+  uint32_t               m_PageIndex    : 31;
+  // Blocks refer to each other by 32-bit index into the block array rather
+  // than by pointer, which keeps block infos small. Index 0 is never used, so
+  // it stands for "no block".
+  uint32_t               m_Prev;
+  uint32_t               m_Next;
+  // Links for the free bin or pending list this block sits in, so it can be
+  // unlinked in O(1).
+  uint32_t               m_ListPrev;
+  uint32_t               m_ListNext;
+  // When this block was freed, for aging it out of the pending list.
+  uint32_t               m_FreeTime;
+  // The worker ticket for this block's pages. A pending block waits for it
+  // before its pages are reused, and a ready slot before it's handed out.
+  uint32_t               m_WorkTicket;
+  // Canary bytes between the end of the allocation and the guard page. For
+  // a paired block, between the end of the left allocation and the middle,
+  // and m_PairSlack between the end of the right one and the guard page.
+  uint32_t               m_TailSlack    : 16;
+  // Paired blocks have a guard page in front too, and hold two small
+  // allocations in one page: one at the start, one at the end. The halves
+  // bits say which of them are in use.
+  uint32_t               m_Paired       : 1;
+  uint32_t               m_PairHalves   : 2;
+  // Packed blocks are a page of tiny allocations; see DebugPackedPage.
+  uint32_t               m_Packed       : 1;
+  uint32_t               m_PairSlack    : 12;
+  // The index of a packed block's page record in m_PackedPages.
+  uint32_t               m_PackedPage;
+#if DEBUG_HEAP_LINEAR_FREELIST
+  // Position of this block in the free list array.
+  uint32_t               m_FreeListIndex;
+#endif
+} DebugBlockInfo;
+
+typedef struct DebugSegment
+{
+  // NULL if this slot has no segment.
+  char*            m_Base;
+  uint32_t         m_PageCount;
+  // Allocated and pending blocks in this segment. It can be released when
+  // this drops to zero.
+  uint32_t         m_BlockCount;
+  // With guard regions, pages below this are accessible and guarded.
+  uint32_t         m_PreparedPageCount;
+} DebugSegment;
+
+// Maps an address granule to one of the segments overlapping it. A segment
+// is smaller than a granule, so it overlaps at most two.
+typedef struct DebugSegmentHashEntry
+{
+  uintptr_t        m_Granule;
+  // Slot number plus one, or zero if the entry is empty.
+  uint32_t         m_Slot;
+} DebugSegmentHashEntry;
+
+// Pages queued for decommit.
+typedef struct DebugDecommitRange
+{
+  uint32_t         m_PageIndex;
+  uint32_t         m_PageCount;
+} DebugDecommitRange;
+
+// A range handed to the worker.
+typedef struct DebugWorkItem
+{
+  char*            m_Base;
+  size_t           m_Size;
+  uint32_t         m_Op;
+} DebugWorkItem;
+
+// A background thread that releases the pages of freed blocks and commits
+// ready slots. Every range gets the next ticket, and ranges are done in
+// order, so a ticket is done once m_Completed has reached it. m_Completed
+// is only written under the lock, but can be read without it. Ticket t
+// lives in m_Items[t % size] until then; the heap only writes items past
+// m_Issued.
+typedef struct DebugWorker
+{
+  DebugHeapMutex   m_Lock;
+  DebugHeapCond    m_WorkReady;
+  DebugHeapCond    m_WorkDone;
+  DebugHeapThread  m_Thread;
+  uint32_t         m_Issued;
+  DebugHeapAtomicType m_Completed;
+  uint32_t         m_Stop;
+  uint32_t         m_Idle;
+  uint32_t         m_Calls;
+  DebugWorkItem    m_Items[kWorkerQueueSize];
+} DebugWorker;
+
+// Blocks of one size, placed and committed ahead of time, oldest first.
+typedef struct DebugReadyPool
+{
+  uint32_t         m_Slots[kReadyPoolCapacity];
+  uint32_t         m_Head;
+  uint32_t         m_Count;
+  uint32_t         m_Target;
+  // Allocations of this size so far this epoch.
+  uint32_t         m_Requests;
+} DebugReadyPool;
+
+// Side metadata for a packed page, kept out of the page so overruns can't
+// corrupt it. Free slots are poisoned.
+typedef struct DebugPackedPage
+{
+  uint64_t         m_Used[kPackedMaxSlots / 64];
+  // The block holding the page.
+  uint32_t         m_Block;
+  // Links for the class's list of pages with free slots. Unused records are
+  // linked through m_PartialNext.
+  uint32_t         m_PartialPrev;
+  uint32_t         m_PartialNext;
+  uint16_t         m_UsedCount;
+  uint8_t          m_Class;
+  // Where the search for a free slot starts.
+  uint8_t          m_Cursor;
+  uint8_t          m_Sizes[kPackedMaxSlots];
+} DebugPackedPage;
+
+typedef struct DebugPackedClass
+{
+  // The page slots are taken from, and the other pages with free slots,
+  // oldest first. Full pages are on neither. These are record indices.
+  uint32_t         m_Current;
+  uint32_t         m_PartialHead;
+  uint32_t         m_PartialTail;
+} DebugPackedClass;
+
+// A bookkeeping array that is reserved for the worst case up front, but
+// only committed as far as it has actually been used.
+typedef struct DebugCommitRange
+{
+  char*            m_Base;
+  size_t           m_CommittedBytes;
+  size_t           m_ReservedBytes;
+} DebugCommitRange;
+
+struct DebugHeap
+{
+  size_t           m_ReservedBytes;
+  uint32_t         m_MaxAllocs;
+  uint32_t         m_Engine;
+
+  // Page indices are global. The bits above m_SlotShift pick the segment
+  // slot, and the rest index pages within the segment. Segments are always
+  // smaller than their slot, so a block can never run from one segment into
+  // the next.
+  uint32_t         m_SlotShift;
+  uint32_t         m_MaxSegments;
+  uint32_t         m_SegmentCount;
+  uint32_t         m_GrowPageCount;
+  uint32_t         m_SegmentPageLimit;
+  DebugSegment     m_Segments[kMaxSegments];
+  uint32_t         m_GranuleShift;
+  DebugSegmentHashEntry m_SegmentHash[kSegmentHashSize];
+
+  // Non-zero if inaccessible pages are made with guard regions rather than
+  // page protection.
+  uint32_t         m_GuardRegions;
+
+  // Estimated number of memory mappings in use, and how many the heap may
+  // use before allocations start failing. A zero budget means no limit.
+  uint32_t         m_MappingsPerAlloc;
+  uint32_t         m_MappingCount;
+  uint32_t         m_MappingBudget;
+  uint32_t         m_MappingFailures;
+
+  // Freed blocks waiting to be decommitted, with neighbors merged. The
+  // queue is flushed when it reaches m_DecommitBatch ranges, and before any
+  // pending block can be reused.
+  uint32_t         m_DecommitBatch;
+  uint32_t         m_DecommitCount;
+  DebugDecommitRange m_DecommitQueue[kDecommitQueueSize];
+  int              m_BatchHandle;
+
+  // With asynchronous decommit, freed blocks are made inaccessible right
+  // away, and the worker releases their pages. The worker also commits ready
+  // slots. Waits counts the times the heap needed pages before the worker
+  // got to them.
+  uint32_t         m_AsyncDecommit;
+  uint32_t         m_AsyncWaits;
+  uint32_t         m_WorkerRunning;
+  DebugWorker      m_Worker;
+
+  // Ready slots for small allocations, topped up as they're used. The
+  // worker commits them, so handing one out takes no system calls. Zero
+  // m_ReadySlots means there are none.
+  uint32_t         m_ReadySlots;
+  uint32_t         m_ReadyEpochRequests;
+  uint32_t         m_ReadyHits;
+  uint32_t         m_ReadyMisses;
+  DebugReadyPool   m_ReadyPools[kReadyPoolCount];
+
+  // Where segments come from and how their pages are protected. Guard
+  // regions are only used with the platform backend.
+  DebugHeapVmBackend m_Vm;
+
+  // A set bit means the page is accessible. Protection changes are trimmed
+  // to the pages that actually need it, and skipped if none do. Requests
+  // count every change asked for, calls the ones that reached the system.
+  uint64_t*        m_AccessBits;
+  uint32_t         m_ProtectRequests;
+  uint32_t         m_ProtectCalls;
+
+  // Freed blocks are poisoned and left committed rather than decommitted,
+  // as long as the accessible pages outside allocations and ready slots stay
+  // within the budget. That count is the accessible pages less the body
+  // pages of placed blocks.
+  uint32_t         m_AccessiblePageCount;
+  uint32_t         m_BodyPageCount;
+  uint32_t         m_PoisonBudgetPages;
+  uint32_t         m_PoisonedFrees;
+
+  // Allocation starts rotate through this many cache lines, counted by the
+  // cursor. Zero places every allocation right against its guard page.
+  uint32_t         m_CacheColors;
+  uint32_t         m_ColorCursor;
+
+  // At most this many bytes in front of an allocation get the fill pattern.
+  // Zero fills all the way to the start of the page.
+  uint32_t         m_FillWindow;
+
+  // Non-zero puts a canary in the alignment slack after each allocation.
+  uint32_t         m_TailCanary;
+
+  // Small allocations share paired blocks. The open pair has its left half
+  // in use and its right half ready for the next one.
+  uint32_t         m_PairedLayout;
+  uint32_t         m_OpenPair;
+
+  // Tiny allocations are packed into pages, a size class per page. The side
+  // metadata of packed pages is a pool of records, recycled through
+  // m_FirstUnusedPackedPage like block infos. Every packed page takes a
+  // guard page too, so half as many records as pages are reserved.
+  uint32_t         m_PackedMaxSize;
+  uint32_t         m_PackedPageCount;
+  uint32_t         m_PackedSlotCount;
+  DebugPackedClass m_PackedClasses[kPackedClassCount];
+  uint32_t         m_FirstUnusedPackedPage;
+  uint32_t         m_PackedPageRecordCount;
+  DebugPackedPage* m_PackedPages;
+  DebugCommitRange m_PackedPagesCommit;
+
+#if DEBUG_HEAP_LINEAR_FREELIST
+  uint32_t         m_FreeListSize;
+  uint32_t*        m_FreeList;
+  DebugCommitRange m_FreeListCommit;
+#else
+  uint64_t         m_FreeBinMask[kFreeBinMaskWords];
+  uint32_t         m_FreeBins[kFreeBinCount];
+#endif
+
+  uint32_t         m_FreePageCount;
+
+  // Freed blocks waiting to be coalesced, oldest first.
+  uint32_t         m_PendingListSize;
+  uint32_t         m_PendingPageCount;
+  uint32_t         m_PendingHead;
+  uint32_t         m_PendingTail;
+
+  uint32_t         m_FlushBudget;
+  uint32_t         m_FlushLowWatermark;
+
+  // Pending list limits; zero means unlimited.
+  uint32_t         m_QuarantinePages;
+  uint32_t         m_QuarantineBlocks;
+  uint32_t         m_QuarantineMs;
+
+  // Bitmap engine state. A set bit in level 0 means the page is allocated or
+  // pending. A set bit in a higher level means that word of the level below
+  // is full, so searches for free pages can skip it.
+  uint32_t         m_BitmapLevelCount;
+  uint32_t         m_BitmapWordCount[kBitmapMaxLevels];
+  uint64_t*        m_Bitmap[kBitmapMaxLevels];
+
+  // Index of the block starting at each page, for allocated blocks only.
+  // This is a two-level table so huge, sparsely used heaps don't pay for it
+  // up front. The directory has an entry per kLookupLeafPages pages, holding
+  // one plus the number of the leaf for that range, or zero if no block has
+  // started there yet. Leaves are handed out in order as they're needed.
+  uint32_t*        m_LookupDirectory;
+  DebugCommitRange m_LookupDirectoryCommit;
+  uint32_t*        m_LookupLeaves;
+  uint32_t         m_LookupLeafCount;
+  DebugCommitRange m_LookupLeavesCommit;
+
+  // Block infos are recycled through m_FirstUnusedBlockInfo, and only carved
+  // off the end of m_Blocks when there is nothing to recycle. The array is
+  // reserved for one block per page, which is as fragmented as the heap can
+  // get, and committed a chunk at a time as the high-water mark rises.
+  uint32_t         m_FirstUnusedBlockInfo;
+  DebugBlockInfo*  m_Blocks;
+  uint32_t         m_BlockInfoCount;
+  uint32_t         m_BlockInfoLiveCount;
+  DebugCommitRange m_BlocksCommit;
+
+  DebugHeapAtomicType m_ReentrancyGuard;
+};
+
+#define DEBUG_THREAD_GUARD_ENTER(heap) \
+  ASSERT_FATAL(1 == AtomicInc32(&heap->m_ReentrancyGuard), "Unsynchronized MT usage detected")
+
+#define DEBUG_THREAD_GUARD_LEAVE(heap) \
+  ASSERT_FATAL(0 == AtomicDec32(&heap->m_ReentrancyGuard), "Unsynchronized MT usage detected")
+
+static DebugBlockInfo* BlockAt(const DebugHeap* heap, uint32_t index)
+{
+  return index ? &heap->m_Blocks[index] : NULL;
+}
+
+static uint32_t BlockIndexOf(const DebugHeap* heap, const DebugBlockInfo* block)
+{
+  return block ? (uint32_t) (block - heap->m_Blocks) : 0;
+}
+
+static char* PageAddress(const DebugHeap* heap, uint32_t page_index)
+{
+  const DebugSegment* segment = &heap->m_Segments[page_index >> heap->m_SlotShift];
+  return segment->m_Base + ((uint64_t) (page_index & ((1u << heap->m_SlotShift) - 1))) * kPageSize;
+}
+
+// Make sure guard regions cover a range of pages before it is handed out.
+static void PreparePages(DebugHeap* heap, uint32_t page_index, uint32_t page_count)
+{
+  DebugSegment* segment = &heap->m_Segments[page_index >> heap->m_SlotShift];
+  uint32_t end = (page_index & ((1u << heap->m_SlotShift) - 1)) + page_count;
+  uint32_t prepared = segment->m_PreparedPageCount;
+  char* base;
+
+  if (end <= prepared)
+    return;
+
+  end = (end + kGuardPrepareChunk - 1) & ~(uint32_t) (kGuardPrepareChunk - 1);
+  if (end > segment->m_PageCount)
+    end = segment->m_PageCount;
+
+  base = segment->m_Base + (uint64_t) prepared * kPageSize;
+  VmCommit(base, (uint64_t) (end - prepared) * kPageSize);
+  VmGuardInstall(base, (uint64_t) (end - prepared) * kPageSize);
+  segment->m_PreparedPageCount = end;
+}
+
+// Shrink a range of pages to the span that isn't already accessible (or
+// inaccessible), and mark the whole range as changed. Pages inside the span
+// that are already right come along for free, so one call still covers it.
+// Returns zero if nothing needs to change.
+static int PagesTrim(DebugHeap* heap, uint32_t* page_index, uint32_t* page_count, int accessible)
+{
+  uint64_t* const bits = heap->m_AccessBits;
+  const uint32_t begin = *page_index;
+  const uint32_t end = begin + *page_count;
+  uint32_t first = ~0u, last = 0;
+  uint32_t word;
+
+  if (0 == *page_count)
+    return 0;
+
+  for (word = begin / 64; word <= (end - 1) / 64; ++word)
+  {
+    uint32_t lo = word * 64 < begin ? begin - word * 64 : 0;
+    uint32_t hi = (word + 1) * 64 > end ? end - word * 64 : 64;
+    uint64_t mask = (64 == hi - lo ? ~(uint64_t)0 : (((uint64_t)1 << (hi - lo)) - 1)) << lo;
+    uint64_t wrong = (accessible ? ~bits[word] : bits[word]) & mask;
+
+    if (wrong)
+    {
+      if (~0u == first)
+        first = word * 64 + CountTrailingZeros64(wrong);
+      last = word * 64 + 63 - CountLeadingZeros64(wrong);
+
+      if (accessible)
+        heap->m_AccessiblePageCount += PopCount64(wrong);
+      else
+        heap->m_AccessiblePageCount -= PopCount64(wrong);
+    }
+
+    bits[word] = accessible ? bits[word] | mask : bits[word] & ~mask;
+  }
+
+  if (~0u == first)
+    return 0;
+
+  *page_index = first;
+  *page_count = last - first + 1;
+  return 1;
+}
+
+static int PageAccessible(const DebugHeap* heap, uint32_t page_index)
+{
+  return (int) ((heap->m_AccessBits[page_index / 64] >> (page_index % 64)) & 1);
+}
+
+// Accessible pages outside allocations and ready slots. These are mostly
+// poisoned freed blocks, and free pages they were coalesced into.
+static uint32_t PoisonedPageCount(const DebugHeap* heap)
+{
+  return heap->m_AccessiblePageCount > heap->m_BodyPageCount ? heap->m_AccessiblePageCount - heap->m_BodyPageCount : 0;
+}
+
+// Make user pages accessible, or inaccessible again.
+static void PagesCommit(DebugHeap* heap, uint32_t page_index, uint32_t page_count)
+{
+  char* ptr;
+  size_t size;
+
+  heap->m_ProtectRequests++;
+  if (!PagesTrim(heap, &page_index, &page_count, 1))
+    return;
+
+  ptr = PageAddress(heap, page_index);
+  size = (uint64_t) page_count * kPageSize;
+  heap->m_ProtectCalls++;
+
+  if (heap->m_GuardRegions)
+    VmGuardRemove(ptr, size);
+  else
+    heap->m_Vm.m_Commit(heap->m_Vm.m_Context, ptr, size);
+}
+
+static void PagesDecommit(DebugHeap* heap, uint32_t page_index, uint32_t page_count)
+{
+  char* ptr;
+  size_t size;
+
+  heap->m_ProtectRequests++;
+  if (!PagesTrim(heap, &page_index, &page_count, 0))
+    return;
+
+  ptr = PageAddress(heap, page_index);
+  size = (uint64_t) page_count * kPageSize;
+  heap->m_ProtectCalls++;
+
+  if (heap->m_GuardRegions)
+    VmGuardInstall(ptr, size);
+  else
+    heap->m_Vm.m_Decommit(heap->m_Vm.m_Context, ptr, size);
+}
+
+// Issue all queued decommits.
+static void FlushDecommits(DebugHeap* heap)
+{
+  char* bases[kDecommitQueueSize];
+  size_t sizes[kDecommitQueueSize];
+  uint32_t i, count = 0;
+
+  // Ranges are trimmed here rather than when queued, and the ones with
+  // nothing left to do are dropped.
+  for (i = 0; i < heap->m_DecommitCount; ++i)
+  {
+    uint32_t page_index = heap->m_DecommitQueue[i].m_PageIndex;
+    uint32_t page_count = heap->m_DecommitQueue[i].m_PageCount;
+
+    if (!PagesTrim(heap, &page_index, &page_count, 0))
+      continue;
+
+    bases[count] = PageAddress(heap, page_index);
+    sizes[count] = (uint64_t) page_count * kPageSize;
+    ++count;
+  }
+
+  heap->m_DecommitCount = 0;
+
+  if (0 == count)
+    return;
+
+  if (heap->m_GuardRegions && heap->m_BatchHandle >= 0)
+  {
+    heap->m_ProtectCalls++;
+    if (VmGuardInstallBatch(heap->m_BatchHandle, bases, sizes, count))
+      return;
+
+    // The kernel can't batch these, so stop trying.
+    VmBatchClose(heap->m_BatchHandle);
+    heap->m_BatchHandle = -1;
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    heap->m_ProtectCalls++;
+    if (heap->m_GuardRegions)
+      VmGuardInstall(bases[i], sizes[i]);
+    else
+      heap->m_Vm.m_Decommit(heap->m_Vm.m_Context, bases[i], sizes[i]);
+  }
+}
+
+static void WorkerMain(void* arg)
+{
+  DebugWorker* worker = (DebugWorker*) arg;
+
+  MutexLock(&worker->m_Lock);
+
+  for (;;)
+  {
+    uint32_t first, count, calls = 0, i = 0;
+
+    while (worker->m_Issued == (uint32_t) worker->m_Completed && !worker->m_Stop)
+    {
+      worker->m_Idle = 1;
+      CondWait(&worker->m_WorkReady, &worker->m_Lock);
+      worker->m_Idle = 0;
+    }
+
+    // Drain everything before stopping.
+    if (worker->m_Issued == (uint32_t) worker->m_Completed)
+      break;
+
+    first = (uint32_t) worker->m_Completed + 1;
+    count = worker->m_Issued - (uint32_t) worker->m_Completed;
+    MutexUnlock(&worker->m_Lock);
+
+    // Take everything queued as one batch, merging neighbors.
+    while (i < count)
+    {
+      const DebugWorkItem* item = &worker->m_Items[(first + i++) % kWorkerQueueSize];
+      const DebugWorkItem* next;
+      char* base = item->m_Base;
+      size_t size = item->m_Size;
+
+      while (i < count && (next = &worker->m_Items[(first + i) % kWorkerQueueSize])->m_Base == base + size && next->m_Op == item->m_Op)
+      {
+        size += next->m_Size;
+        ++i;
+      }
+
+      if (kWorkCommit == item->m_Op)
+        VmCommit(base, size);
+      else if (kWorkGuardRemove == item->m_Op)
+        VmGuardRemove(base, size);
+      else
+        VmDecommit(base, size);
+      ++calls;
+    }
+
+    MutexLock(&worker->m_Lock);
+    AtomicStore32(&worker->m_Completed, (uint32_t) worker->m_Completed + count);
+    worker->m_Calls += calls;
+    CondBroadcast(&worker->m_WorkDone);
+  }
+
+  MutexUnlock(&worker->m_Lock);
+}
+
+// Hand a range to the worker, waiting for room if its queue is full.
+// Returns the range's ticket.
+static uint32_t WorkerSubmit(DebugWorker* worker, uint32_t op, char* base, size_t size)
+{
+  uint32_t ticket;
+
+  MutexLock(&worker->m_Lock);
+
+  while (worker->m_Issued - (uint32_t) worker->m_Completed == kWorkerQueueSize)
+    CondWait(&worker->m_WorkDone, &worker->m_Lock);
+
+  ticket = worker->m_Issued + 1;
+  worker->m_Items[ticket % kWorkerQueueSize].m_Base = base;
+  worker->m_Items[ticket % kWorkerQueueSize].m_Size = size;
+  worker->m_Items[ticket % kWorkerQueueSize].m_Op = op;
+  worker->m_Issued = ticket;
+
+  // A busy worker picks this up with its next batch, so only wake it if it's
+  // idle.
+  if (worker->m_Idle)
+    CondBroadcast(&worker->m_WorkReady);
+
+  MutexUnlock(&worker->m_Lock);
+  return ticket;
+}
+
+static int WorkerDone(DebugWorker* worker, uint32_t ticket)
+{
+  return (int32_t) (ticket - AtomicLoad32(&worker->m_Completed)) <= 0;
+}
+
+// Wait until the worker is done with a block's pages.
+static void WorkerWait(DebugHeap* heap, uint32_t ticket)
+{
+  DebugWorker* worker = &heap->m_Worker;
+
+  if (WorkerDone(worker, ticket))
+    return;
+
+  heap->m_AsyncWaits++;
+
+  MutexLock(&worker->m_Lock);
+  while (!WorkerDone(worker, ticket))
+    CondWait(&worker->m_WorkDone, &worker->m_Lock);
+  MutexUnlock(&worker->m_Lock);
+}
+
+static int WorkerStart(DebugWorker* worker)
+{
+  MutexInit(&worker->m_Lock);
+  CondInit(&worker->m_WorkReady);
+  CondInit(&worker->m_WorkDone);
+  worker->m_Issued = 0;
+  worker->m_Completed = 0;
+  worker->m_Stop = 0;
+  worker->m_Idle = 0;
+  worker->m_Calls = 0;
+
+  if (ThreadStart(&worker->m_Thread, worker))
+    return 1;
+
+  CondDestroy(&worker->m_WorkDone);
+  CondDestroy(&worker->m_WorkReady);
+  MutexDestroy(&worker->m_Lock);
+  return 0;
+}
+
+// Finish all queued work and stop the thread.
+static void WorkerStop(DebugWorker* worker)
+{
+  MutexLock(&worker->m_Lock);
+  worker->m_Stop = 1;
+  CondBroadcast(&worker->m_WorkReady);
+  MutexUnlock(&worker->m_Lock);
+
+  ThreadJoin(worker->m_Thread);
+  CondDestroy(&worker->m_WorkDone);
+  CondDestroy(&worker->m_WorkReady);
+  MutexDestroy(&worker->m_Lock);
+}
+
+static int DecommitQueued(const DebugHeap* heap, const DebugBlockInfo* block)
+{
+  uint32_t first = block->m_PageIndex;
+  uint32_t end = first + block->m_PageCount;
+  uint32_t i;
+
+  for (i = 0; i < heap->m_DecommitCount; ++i)
+  {
+    const DebugDecommitRange* range = &heap->m_DecommitQueue[i];
+    if (range->m_PageIndex < end && first < range->m_PageIndex + range->m_PageCount)
+      return 1;
+  }
+
+  return 0;
+}
+
+// Decommit a freed block's pages, or queue them up if batching is enabled.
+// Queued blocks include their guard page, so that neighboring blocks merge
+// into one range.
+static void QueueDecommit(DebugHeap* heap, DebugBlockInfo* block)
+{
+  DebugDecommitRange* range;
+  uint32_t i;
+
+  if (heap->m_AsyncDecommit)
+  {
+    uint32_t page_index = block->m_PageIndex;
+    uint32_t page_count = block->m_PageCount;
+
+    // Blocks with nothing to release just wait for whatever came before.
+    block->m_WorkTicket = heap->m_Worker.m_Issued;
+
+    heap->m_ProtectRequests++;
+    if (!PagesTrim(heap, &page_index, &page_count, 0))
+      return;
+
+    heap->m_ProtectCalls++;
+    VmProtectNone(PageAddress(heap, page_index), (uint64_t) page_count * kPageSize);
+    block->m_WorkTicket = WorkerSubmit(&heap->m_Worker, kWorkDecommit, PageAddress(heap, page_index), (uint64_t) page_count * kPageSize);
+    return;
+  }
+
+  if (heap->m_DecommitBatch <= 1)
+  {
+    PagesDecommit(heap, block->m_PageIndex, block->m_PageCount);
+    return;
+  }
+
+  heap->m_ProtectRequests++;
+
+  for (i = 0; i < heap->m_DecommitCount; ++i)
+  {
+    range = &heap->m_DecommitQueue[i];
+
+    if (range->m_PageIndex + range->m_PageCount == (uint32_t) block->m_PageIndex)
+    {
+      range->m_PageCount += block->m_PageCount;
+      return;
+    }
+
+    if ((uint32_t) (block->m_PageIndex + block->m_PageCount) == range->m_PageIndex)
+    {
+      range->m_PageIndex = block->m_PageIndex;
+      range->m_PageCount += block->m_PageCount;
+      return;
+    }
+  }
+
+  range = &heap->m_DecommitQueue[heap->m_DecommitCount++];
+  range->m_PageIndex = block->m_PageIndex;
+  range->m_PageCount = block->m_PageCount;
+
+  if (heap->m_DecommitCount >= heap->m_DecommitBatch)
+    FlushDecommits(heap);
+}
+
+static uint32_t SegmentHashHome(uintptr_t granule)
+{
+  return (uint32_t) (((uint64_t) granule * 0x9e3779b97f4a7c15ull) >> (64 - kSegmentHashBits));
+}
+
+static void SegmentHashInsert(DebugHeap* heap, uintptr_t granule, uint32_t slot)
+{
+  uint32_t i = SegmentHashHome(granule);
+
+  while (heap->m_SegmentHash[i].m_Slot)
+    i = (i + 1) & (kSegmentHashSize - 1);
+
+  heap->m_SegmentHash[i].m_Granule = granule;
+  heap->m_SegmentHash[i].m_Slot = slot + 1;
+}
+
+static void SegmentHashRemove(DebugHeap* heap, uintptr_t granule, uint32_t slot)
+{
+  DebugSegmentHashEntry* table = heap->m_SegmentHash;
+  uint32_t i = SegmentHashHome(granule);
+
+  while (table[i].m_Granule != granule || table[i].m_Slot != slot + 1)
+  {
+    ASSERT_FATAL(table[i].m_Slot, "segment table corrupted");
+    i = (i + 1) & (kSegmentHashSize - 1);
+  }
+
+  // Linear probing deletion: pull later entries of the probe run back into
+  // the hole, unless that would move them before their home position.
+  for (;;)
+  {
+    uint32_t j = i;
+    uint32_t home;
+
+    table[i].m_Slot = 0;
+
+    do
+    {
+      j = (j + 1) & (kSegmentHashSize - 1);
+      if (!table[j].m_Slot)
+        return;
+      home = SegmentHashHome(table[j].m_Granule);
+    } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+    table[i] = table[j];
+    i = j;
+  }
+}
+
+static void SegmentRegister(DebugHeap* heap, uint32_t slot, int insert)
+{
+  const DebugSegment* segment = &heap->m_Segments[slot];
+  uintptr_t first = (uintptr_t) segment->m_Base >> heap->m_GranuleShift;
+  uintptr_t last = ((uintptr_t) segment->m_Base + (uint64_t) segment->m_PageCount * kPageSize - 1) >> heap->m_GranuleShift;
+  uintptr_t granule;
+
+  for (granule = first; granule <= last; ++granule)
+  {
+    if (insert)
+      SegmentHashInsert(heap, granule, slot);
+    else
+      SegmentHashRemove(heap, granule, slot);
+  }
+}
+
+// Find the global page index for an address. Returns zero if the address
+// isn't in any segment.
+static int PageIndexOf(const DebugHeap* heap, const void* ptr_in, uint32_t* page_index_out)
+{
+  uintptr_t ptr = (uintptr_t) ptr_in;
+  uintptr_t granule = ptr >> heap->m_GranuleShift;
+  uint32_t i;
+
+  for (i = SegmentHashHome(granule); heap->m_SegmentHash[i].m_Slot; i = (i + 1) & (kSegmentHashSize - 1))
+  {
+    uint32_t slot = heap->m_SegmentHash[i].m_Slot - 1;
+    const DebugSegment* segment = &heap->m_Segments[slot];
+    uintptr_t base = (uintptr_t) segment->m_Base;
+
+    if (heap->m_SegmentHash[i].m_Granule != granule)
+      continue;
+
+    if (ptr >= base && ptr - base < (uint64_t) segment->m_PageCount * kPageSize)
+    {
+      *page_index_out = (slot << heap->m_SlotShift) + (uint32_t) ((ptr - base) / kPageSize);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static size_t RoundUpToPage(size_t bytes)
+{
+  return (bytes + kPageSize - 1) & ~((size_t) kPageSize - 1);
+}
+
+// Make sure the first bytes_needed bytes of a bookkeeping array are committed.
+static void CommitRangeGrow(DebugCommitRange* range, size_t bytes_needed)
+{
+  size_t new_size;
+
+  if (bytes_needed <= range->m_CommittedBytes)
+    return;
+
+  ASSERT_FATAL(bytes_needed <= range->m_ReservedBytes, "bookkeeping overflow");
+
+  new_size = (bytes_needed + kBookkeepingCommitChunk - 1) & ~((size_t) kBookkeepingCommitChunk - 1);
+  if (new_size > range->m_ReservedBytes)
+    new_size = range->m_ReservedBytes;
+
+  VmCommit(range->m_Base + range->m_CommittedBytes, new_size - range->m_CommittedBytes);
+  range->m_CommittedBytes = new_size;
+}
+
+// Carve the next bookkeeping array out of the reservation.
+static void* CommitRangeInit(DebugCommitRange* range, char** cursor, size_t reserved_bytes)
+{
+  range->m_Base           = *cursor;
+  range->m_CommittedBytes = 0;
+  range->m_ReservedBytes  = reserved_bytes;
+  *cursor += reserved_bytes;
+  return range->m_Base;
+}
+
+static DebugBlockInfo* GetBlockLookup(const DebugHeap* heap, uint32_t page_index)
+{
+  uint32_t directory_index = page_index >> kLookupLeafShift;
+  uint32_t leaf;
+
+  // No leaf means no block has ever started in this range.
+  if ((directory_index + (size_t) 1) * sizeof(uint32_t) > heap->m_LookupDirectoryCommit.m_CommittedBytes)
+    return NULL;
+
+  if (0 == (leaf = heap->m_LookupDirectory[directory_index]))
+    return NULL;
+
+  return BlockAt(heap, heap->m_LookupLeaves[((leaf - 1) << kLookupLeafShift) + (page_index & (kLookupLeafPages - 1))]);
+}
+
+static void SetBlockLookup(DebugHeap* heap, uint32_t page_index, DebugBlockInfo* block)
+{
+  uint32_t directory_index = page_index >> kLookupLeafShift;
+  uint32_t leaf;
+
+  CommitRangeGrow(&heap->m_LookupDirectoryCommit, (directory_index + (size_t) 1) * sizeof(uint32_t));
+
+  if (0 == (leaf = heap->m_LookupDirectory[directory_index]))
+  {
+    // Freshly committed memory is zero, which is what an empty leaf looks like.
+    leaf = ++heap->m_LookupLeafCount;
+    CommitRangeGrow(&heap->m_LookupLeavesCommit, (size_t) leaf * kLookupLeafPages * sizeof(uint32_t));
+    heap->m_LookupDirectory[directory_index] = leaf;
+  }
+
+  heap->m_LookupLeaves[((leaf - 1) << kLookupLeafShift) + (page_index & (kLookupLeafPages - 1))] = BlockIndexOf(heap, block);
+}
+
+// Returns NULL if the heap is out of block infos.
+DebugBlockInfo* AllocBlockInfo(DebugHeap* heap)
+{
+  DebugBlockInfo* result = BlockAt(heap, heap->m_FirstUnusedBlockInfo);
+
+  if (result)
+  {
+    ASSERT_FATAL((uint32_t)result->m_Allocated, "Block info corrupted");
+    ASSERT_FATAL((uint32_t)result->m_PendingFree, "Block info corrupted");
+    heap->m_FirstUnusedBlockInfo = result->m_Next;
+  }
+  else
+  {
+    // Nothing to recycle, so take a fresh one off the end of the array.
+    // m_BlockInfoCount starts at one, as index zero means "no block".
+    if (heap->m_BlockInfoCount > heap->m_MaxAllocs)
+      return NULL;
+    CommitRangeGrow(&heap->m_BlocksCommit, (heap->m_BlockInfoCount + (size_t) 1) * sizeof(DebugBlockInfo));
+    result = &heap->m_Blocks[heap->m_BlockInfoCount++];
+  }
+
+  memset(result, 0, sizeof *result);
+  heap->m_BlockInfoLiveCount++;
+
+  return result;
+}
+
+void FreeBlockInfo(DebugHeap* heap, DebugBlockInfo* block_info)
+{
+  block_info->m_Allocated = 1;
+  block_info->m_PendingFree = 1;
+  block_info->m_Prev = 0;
+  block_info->m_Next = heap->m_FirstUnusedBlockInfo;
+  heap->m_FirstUnusedBlockInfo = BlockIndexOf(heap, block_info);
+  heap->m_BlockInfoLiveCount--;
+}
+
+#if DEBUG_HEAP_LINEAR_FREELIST
+static void FreeListInsert(DebugHeap* heap, DebugBlockInfo* block)
+{
+  CommitRangeGrow(&heap->m_FreeListCommit, (heap->m_FreeListSize + (size_t) 1) * sizeof(uint32_t));
+  heap->m_FreePageCount += block->m_PageCount;
+  block->m_FreeListIndex = heap->m_FreeListSize;
+  heap->m_FreeList[heap->m_FreeListSize++] = BlockIndexOf(heap, block);
+}
+
+static void FreeListRemove(DebugHeap* heap, DebugBlockInfo* block)
+{
+  uint32_t index = block->m_FreeListIndex;
+  DebugBlockInfo* last;
+
+  ASSERT_FATAL(index < heap->m_FreeListSize && BlockAt(heap, heap->m_FreeList[index]) == block, "free list corrupted");
+
+  heap->m_FreePageCount -= block->m_PageCount;
+
+  // Move the last entry into the hole.
+  last = BlockAt(heap, heap->m_FreeList[--heap->m_FreeListSize]);
+  last->m_FreeListIndex = index;
+  heap->m_FreeList[index] = BlockIndexOf(heap, last);
+}
+
+static DebugBlockInfo* FreeListTakeBest(DebugHeap* heap, uint32_t page_req)
+{
+  // Cache in register to avoid repeated memory derefs
+  const uint32_t* const free_list = heap->m_FreeList;
+
+  // Keep track of the best fitting block so far.
+  DebugBlockInfo* best_block = NULL;
+  uint32_t best_block_size = ~0u;
+  uint32_t i, count;
+
+  // Scan the whole free list. This is slow. That's OK. It's a debug heap.
+  for (i = 0, count = heap->m_FreeListSize; i < count; ++i)
+  {
+    DebugBlockInfo* block = BlockAt(heap, free_list[i]);
+    uint32_t block_count = block->m_PageCount;
+    ASSERT_FATAL(!block->m_Allocated, "block info corrupted");
+    ASSERT_FATAL(!block->m_PendingFree, "block info corrupted");
+
+    if (block_count >= page_req && block_count < best_block_size)
+    {
+      best_block = block;
+      best_block_size = block_count;
+    }
+  }
+
+  if (best_block)
+  {
+    // Take this block off the free list. FreeListRemove checks that its
+    // index still points back at it.
+    FreeListRemove(heap, best_block);
+  }
+
+  return best_block;
+}
+#else
+static uint32_t FreeBinIndex(uint32_t page_count)
+{
+  uint32_t log2, sub_bin;
+
+  if (page_count < kExactBinCount)
+    return page_count;
+
+  log2    = 63 - CountLeadingZeros64(page_count);
+  sub_bin = (page_count >> (log2 - kSubBinBits)) & ((1u << kSubBinBits) - 1);
+
+  return kExactBinCount + ((log2 - kExactBinLog2) << kSubBinBits) + sub_bin;
+}
+
+// Returns the first non-empty bin at or above the one given, or kFreeBinCount.
+static uint32_t FreeBinFindNonEmpty(const DebugHeap* heap, uint32_t bin)
+{
+  uint32_t word = bin / 64;
+  uint64_t bits;
+
+  if (bin >= kFreeBinCount)
+    return kFreeBinCount;
+
+  bits = heap->m_FreeBinMask[word] & (~(uint64_t)0 << (bin % 64));
+
+  while (0 == bits)
+  {
+    if (++word == kFreeBinMaskWords)
+      return kFreeBinCount;
+    bits = heap->m_FreeBinMask[word];
+  }
+
+  return word * 64 + CountTrailingZeros64(bits);
+}
+
+static void FreeListInsert(DebugHeap* heap, DebugBlockInfo* block)
+{
+  uint32_t bin = FreeBinIndex(block->m_PageCount);
+  DebugBlockInfo* head = BlockAt(heap, heap->m_FreeBins[bin]);
+
+  heap->m_FreePageCount += block->m_PageCount;
+
+  block->m_ListPrev = 0;
+  block->m_ListNext = heap->m_FreeBins[bin];
+  if (head)
+    head->m_ListPrev = BlockIndexOf(heap, block);
+
+  heap->m_FreeBins[bin] = BlockIndexOf(heap, block);
+  heap->m_FreeBinMask[bin / 64] |= ((uint64_t)1) << (bin % 64);
+}
+
+static void FreeListRemove(DebugHeap* heap, DebugBlockInfo* block)
+{
+  uint32_t bin = FreeBinIndex(block->m_PageCount);
+  DebugBlockInfo* prev = BlockAt(heap, block->m_ListPrev);
+  DebugBlockInfo* next = BlockAt(heap, block->m_ListNext);
+
+  heap->m_FreePageCount -= block->m_PageCount;
+
+  if (prev)
+  {
+    prev->m_ListNext = block->m_ListNext;
+  }
+  else
+  {
+    ASSERT_FATAL(BlockAt(heap, heap->m_FreeBins[bin]) == block, "free list corrupted");
+    heap->m_FreeBins[bin] = block->m_ListNext;
+    if (NULL == next)
+      heap->m_FreeBinMask[bin / 64] &= ~(((uint64_t)1) << (bin % 64));
+  }
+
+  if (next)
+    next->m_ListPrev = block->m_ListPrev;
+
+  block->m_ListPrev = 0;
+  block->m_ListNext = 0;
+}
+
+static DebugBlockInfo* FreeListTakeBest(DebugHeap* heap, uint32_t page_req)
+{
+  uint32_t bin = FreeBinIndex(page_req);
+
+  for (;;)
+  {
+    DebugBlockInfo* block;
+    DebugBlockInfo* best_block = NULL;
+    uint32_t best_block_size = ~0u;
+
+    bin = FreeBinFindNonEmpty(heap, bin);
+
+    if (kFreeBinCount == bin)
+      return NULL;
+
+    // Every block in an exact bin has the same size, and nothing smaller fits.
+    if (bin < kExactBinCount)
+    {
+      block = BlockAt(heap, heap->m_FreeBins[bin]);
+      FreeListRemove(heap, block);
+      return block;
+    }
+
+    // Ranged bins hold a spread of sizes, so find the smallest one that fits.
+    // Only the bin containing page_req can fail to have one; every block in
+    // the bins after it is large enough.
+    for (block = BlockAt(heap, heap->m_FreeBins[bin]); block; block = BlockAt(heap, block->m_ListNext))
+    {
+      uint32_t block_count = block->m_PageCount;
+      ASSERT_FATAL(!block->m_Allocated, "block info corrupted");
+      ASSERT_FATAL(!block->m_PendingFree, "block info corrupted");
+
+      if (block_count >= page_req && block_count < best_block_size)
+      {
+        best_block = block;
+        best_block_size = block_count;
+      }
+    }
+
+    if (best_block)
+    {
+      FreeListRemove(heap, best_block);
+      return best_block;
+    }
+
+    ++bin;
+  }
+}
+#endif
+
+// Mark an entry in a summary level as full or not, and carry the change upward.
+static void BitmapSetFull(DebugHeap* heap, uint32_t level, uint32_t index, int full)
+{
+  for (; level < heap->m_BitmapLevelCount; ++level)
+  {
+    uint64_t* word = &heap->m_Bitmap[level][index / 64];
+    uint64_t old_bits = *word;
+    uint64_t bit = ((uint64_t)1) << (index % 64);
+
+    *word = full ? old_bits | bit : old_bits & ~bit;
+
+    // Stop once the fullness of this word doesn't change.
+    if ((~(uint64_t)0 == old_bits) == (~(uint64_t)0 == *word))
+      break;
+
+    full = ~(uint64_t)0 == *word;
+    index /= 64;
+  }
+}
+
+// Mark a range of pages as in use or free.
+static void BitmapUpdate(DebugHeap* heap, uint32_t first_page, uint32_t page_count, int used)
+{
+  uint64_t* const pages = heap->m_Bitmap[0];
+
+  while (page_count > 0)
+  {
+    uint32_t word  = first_page / 64;
+    uint32_t shift = first_page % 64;
+    uint32_t count = 64 - shift < page_count ? 64 - shift : page_count;
+    uint64_t mask  = (64 == count ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1)) << shift;
+    uint64_t old_bits = pages[word];
+
+    if (used)
+    {
+      ASSERT_FATAL(0 == (old_bits & mask), "page bitmap corrupted");
+      pages[word] = old_bits | mask;
+    }
+    else
+    {
+      ASSERT_FATAL(PopCount64(old_bits & mask) == count, "page bitmap corrupted");
+      pages[word] = old_bits & ~mask;
+    }
+
+    if ((~(uint64_t)0 == old_bits) != (~(uint64_t)0 == pages[word]))
+      BitmapSetFull(heap, 1, word, used);
+
+    first_page += count;
+    page_count -= count;
+  }
+}
+
+// Mark entries first to first + count - 1 of a summary level as full or not,
+// and update the levels above. This is for whole segments, where level 0 is
+// committed or decommitted wholesale instead of being written page by page.
+static void BitmapMarkRange(DebugHeap* heap, uint32_t level, uint32_t first, uint32_t count, int full)
+{
+  uint64_t* const words = heap->m_Bitmap[level];
+  const uint32_t end = first + count;
+  uint32_t word;
+
+  for (word = first / 64; word <= (end - 1) / 64; ++word)
+  {
+    uint32_t lo = word * 64 < first ? first - word * 64 : 0;
+    uint32_t hi = (word + 1) * 64 > end ? end - word * 64 : 64;
+    uint64_t mask = (64 == hi - lo ? ~(uint64_t)0 : (((uint64_t)1 << (hi - lo)) - 1)) << lo;
+    uint64_t old_bits = words[word];
+
+    words[word] = full ? old_bits | mask : old_bits & ~mask;
+
+    if ((~(uint64_t)0 == old_bits) != (~(uint64_t)0 == words[word]))
+      BitmapSetFull(heap, level + 1, word, full);
+  }
+}
+
+// Find the first clear entry at or after index in a level, using the levels
+// above to skip over full words. Returns ~0u if there is none.
+static uint32_t BitmapFindClear(const DebugHeap* heap, uint32_t level, uint32_t index)
+{
+  for (;;)
+  {
+    uint32_t word = index / 64;
+    uint64_t clear_bits;
+
+    if (word >= heap->m_BitmapWordCount[level])
+      return ~0u;
+
+    clear_bits = ~heap->m_Bitmap[level][word] & (~(uint64_t)0 << (index % 64));
+
+    if (clear_bits)
+      return word * 64 + CountTrailingZeros64(clear_bits);
+
+    // This word is done. Ask the level above for the next word with room.
+    // Checking kBitmapMaxLevels too lets the compiler see the bound.
+    if (level + 1 < kBitmapMaxLevels && level + 1 < heap->m_BitmapLevelCount)
+    {
+      uint32_t next_word = BitmapFindClear(heap, level + 1, word + 1);
+      if (~0u == next_word)
+        return ~0u;
+      index = next_word * 64;
+    }
+    else
+    {
+      index = (word + 1) * 64;
+    }
+  }
+}
+
+// Offset of the first run of page_count clear bits that fits entirely within
+// a word, or 64 if there is none. page_count must be 64 or less.
+static uint32_t BitmapFindRunInWord(uint64_t used_bits, uint32_t page_count)
+{
+  uint64_t run_starts = ~used_bits;
+  uint32_t run_length = 1;
+
+  if (PopCount64(run_starts) < page_count)
+    return 64;
+
+  // Shift-and the word with itself, doubling the run length each time, until
+  // the set bits mark where page_count clear bits in a row start.
+  while (run_length < page_count)
+  {
+    uint32_t shift = run_length < page_count - run_length ? run_length : page_count - run_length;
+    run_starts &= run_starts >> shift;
+    run_length += shift;
+  }
+
+  return run_starts ? CountTrailingZeros64(run_starts) : 64;
+}
+
+// First fit search for page_count free pages. Returns the first page, or ~0u.
+static uint32_t BitmapFindRun(const DebugHeap* heap, uint32_t page_count)
+{
+  const uint64_t* const pages = heap->m_Bitmap[0];
+
+  // Free pages at the top of the previous word that the next word can extend.
+  uint32_t carry_start = 0;
+  uint32_t carry_count = 0;
+  uint32_t word = BitmapFindClear(heap, 1, 0);
+  uint32_t prev_word = ~0u;
+
+  while (~0u != word)
+  {
+    uint64_t used_bits = pages[word];
+    uint32_t low_free = used_bits ? CountTrailingZeros64(used_bits) : 64;
+
+    // A full word was skipped, so the run is broken.
+    if (word != prev_word + 1)
+      carry_count = 0;
+
+    if (carry_count + low_free >= page_count)
+      return carry_count ? carry_start : word * 64;
+
+    if (page_count <= 64)
+    {
+      uint32_t offset = BitmapFindRunInWord(used_bits, page_count);
+      if (offset < 64)
+        return word * 64 + offset;
+    }
+
+    if (0 == used_bits)
+    {
+      if (0 == carry_count)
+        carry_start = word * 64;
+      carry_count += 64;
+    }
+    else
+    {
+      carry_count = CountLeadingZeros64(used_bits);
+      carry_start = word * 64 + 64 - carry_count;
+    }
+
+    prev_word = word;
+    word = BitmapFindClear(heap, 1, word + 1);
+  }
+
+  return ~0u;
+}
+
+// Reserve a new segment of page_count pages in the first empty slot, and
+// hand its pages to the placement engine. Returns zero on failure.
+static int AddSegment(DebugHeap* heap, uint32_t page_count)
+{
+  uint32_t slot, first_page;
+  DebugSegment* segment;
+  char* base;
+
+  for (slot = 0; slot < heap->m_MaxSegments && heap->m_Segments[slot].m_Base; ++slot)
+  {
+  }
+
+  if (slot == heap->m_MaxSegments)
+    return 0;
+
+  if (NULL == (base = (char*) heap->m_Vm.m_Allocate(heap->m_Vm.m_Context, (uint64_t) page_count * kPageSize)))
+    return 0;
+
+  first_page = slot << heap->m_SlotShift;
+
+  // New pages are inaccessible, which is what zeroed access bits say.
+  VmCommit(heap->m_AccessBits + first_page / 64, RoundUpToPage((page_count + 63) / 64 * sizeof(uint64_t)));
+
+  if (kDebugHeapEngineBitmap == heap->m_Engine)
+  {
+    // Freshly committed words are zero, so every page is free. Pages past the
+    // end of the segment are marked used, and the level above is told which
+    // words now have room.
+    uint64_t* words = heap->m_Bitmap[0] + first_page / 64;
+    uint32_t word_count = (page_count + 63) / 64;
+
+    VmCommit(words, RoundUpToPage(word_count * sizeof(uint64_t)));
+    if (page_count % 64)
+      words[word_count - 1] = ~(uint64_t)0 << (page_count % 64);
+    BitmapMarkRange(heap, 1, first_page / 64, word_count, 0);
+    heap->m_FreePageCount += page_count;
+  }
+  else
+  {
+    DebugBlockInfo* root_block = AllocBlockInfo(heap);
+
+    if (!root_block)
+    {
+      VmDecommit(heap->m_AccessBits + first_page / 64, RoundUpToPage((page_count + 63) / 64 * sizeof(uint64_t)));
+      heap->m_Vm.m_Free(heap->m_Vm.m_Context, base, (uint64_t) page_count * kPageSize);
+      return 0;
+    }
+
+    root_block->m_PageIndex = first_page;
+    root_block->m_Allocated = 0;
+    root_block->m_PendingFree = 0;
+    root_block->m_PageCount = page_count;
+    root_block->m_Prev = 0;
+    root_block->m_Next = 0;
+
+    FreeListInsert(heap, root_block);
+  }
+
+  segment = &heap->m_Segments[slot];
+  segment->m_Base = base;
+  segment->m_PageCount = page_count;
+  segment->m_BlockCount = 0;
+  segment->m_PreparedPageCount = 0;
+  SegmentRegister(heap, slot, 1);
+  heap->m_SegmentCount++;
+  heap->m_MappingCount++;
+
+  return 1;
+}
+
+// Give a segment with no allocated or pending blocks back to the OS. For the
+// list engine, free_block is the free block covering the whole segment.
+static void ReleaseSegment(DebugHeap* heap, uint32_t slot, DebugBlockInfo* free_block)
+{
+  DebugSegment* segment = &heap->m_Segments[slot];
+
+  if (kDebugHeapEngineBitmap == heap->m_Engine)
+  {
+    // Mark the segment's words full, then drop them so they come back zeroed
+    // if the slot is used again.
+    uint32_t first_word = (slot << heap->m_SlotShift) / 64;
+    uint32_t word_count = (segment->m_PageCount + 63) / 64;
+
+    BitmapMarkRange(heap, 1, first_word, word_count, 1);
+    VmDecommit(heap->m_Bitmap[0] + first_word, RoundUpToPage(word_count * sizeof(uint64_t)));
+    heap->m_FreePageCount -= segment->m_PageCount;
+  }
+  else
+  {
+    ASSERT_FATAL(free_block->m_PageCount == segment->m_PageCount, "segment not fully free");
+    FreeListRemove(heap, free_block);
+    FreeBlockInfo(heap, free_block);
+  }
+
+  {
+    // Poisoned pages can be left accessible in a free segment.
+    uint64_t* bits = heap->m_AccessBits + (slot << heap->m_SlotShift) / 64;
+    uint32_t i, word_count = (segment->m_PageCount + 63) / 64;
+
+    for (i = 0; i < word_count; ++i)
+      heap->m_AccessiblePageCount -= PopCount64(bits[i]);
+
+    VmDecommit(bits, RoundUpToPage(word_count * sizeof(uint64_t)));
+  }
+  SegmentRegister(heap, slot, 0);
+  heap->m_Vm.m_Free(heap->m_Vm.m_Context, segment->m_Base, (uint64_t) segment->m_PageCount * kPageSize);
+  segment->m_Base = NULL;
+  segment->m_PageCount = 0;
+  heap->m_SegmentCount--;
+  heap->m_MappingCount--;
+}
+
+// Add a segment with room for page_req pages. Returns zero on failure.
+static int GrowHeap(DebugHeap* heap, uint32_t page_req)
+{
+  if (page_req > heap->m_SegmentPageLimit)
+    return 0;
+
+  if (heap->m_MappingBudget && heap->m_MappingCount + 1 + heap->m_MappingsPerAlloc > heap->m_MappingBudget)
+    return 0;
+
+  return AddSegment(heap, page_req > heap->m_GrowPageCount ? page_req : heap->m_GrowPageCount);
+}
+
+// Pattern checks. Each returns the offset of the first byte in the range
+// that isn't the fill byte, or the size of the range if they all are. The
+// vector versions compare 64 bytes per iteration, and only work out which
+// byte differs once they find a mismatch.
+typedef size_t (*DebugFillMismatchFn)(const unsigned char* bytes, size_t size, unsigned char fill);
+
+static size_t FillMismatchScalar(const unsigned char* bytes, size_t size, unsigned char fill)
+{
+  size_t i;
+
+  for (i = 0; i < size; ++i)
+  {
+    if (bytes[i] != fill)
+      break;
+  }
+
+  return i;
+}
+
+#if DEBUG_HEAP_SSE2
+static size_t FillMismatchSse2(const unsigned char* bytes, size_t size, unsigned char fill)
+{
+  const __m128i pattern = _mm_set1_epi8((char) fill);
+  size_t i = 0;
+
+  for (; i + 64 <= size; i += 64)
+  {
+    const __m128i* p = (const __m128i*) (bytes + i);
+    __m128i a = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p + 0), pattern), _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), pattern));
+    __m128i b = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), pattern), _mm_cmpeq_epi8(_mm_loadu_si128(p + 3), pattern));
+
+    if (0xffff != _mm_movemask_epi8(_mm_and_si128(a, b)))
+      break;
+  }
+
+  for (; i + 16 <= size; i += 16)
+  {
+    uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (bytes + i)), pattern));
+
+    if (0xffff != mask)
+      return i + CountTrailingZeros64(~mask);
+  }
+
+  return i + FillMismatchScalar(bytes + i, size - i, fill);
+}
+
+DEBUG_HEAP_TARGET_AVX2
+static size_t FillMismatchAvx2(const unsigned char* bytes, size_t size, unsigned char fill)
+{
+  const __m256i pattern = _mm256_set1_epi8((char) fill);
+  size_t i = 0;
+
+  for (; i + 64 <= size; i += 64)
+  {
+    const __m256i* p = (const __m256i*) (bytes + i);
+    __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256(p + 0), pattern);
+    __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256(p + 1), pattern);
+
+    if (~0u != (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(a, b)))
+      break;
+  }
+
+  for (; i + 32 <= size; i += 32)
+  {
+    uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (bytes + i)), pattern));
+
+    if (~0u != mask)
+    {
+      _mm256_zeroupper();
+      return i + CountTrailingZeros64(~(uint64_t) mask);
+    }
+  }
+
+  // Not every compiler clears the upper halves on the way out, and mixing
+  // them with SSE code is slow on some CPUs.
+  _mm256_zeroupper();
+  return i + FillMismatchSse2(bytes + i, size - i, fill);
+}
+
+// Upgraded to AVX2 when the first heap is created, if the CPU has it.
+static DebugFillMismatchFn s_FillMismatch = FillMismatchSse2;
+#else
+static DebugFillMismatchFn s_FillMismatch = FillMismatchScalar;
+#endif
+
+static size_t FillMismatch(const unsigned char* bytes, size_t size, unsigned char fill)
+{
+  return s_FillMismatch(bytes, size, fill);
+}
+
+// Make sure the fill pattern in front of an allocation, of which there are
+// offset bytes, is intact up to the fill window.
+static void LeadingCheck(const DebugHeap* heap, const void* user_ptr, uint32_t offset)
+{
+  const unsigned char* ptr = (const unsigned char*) user_ptr;
+  size_t bad;
+
+  if (heap->m_FillWindow && offset > heap->m_FillWindow)
+    offset = heap->m_FillWindow;
+
+  bad = FillMismatch(ptr - offset, offset, 0xfc);
+  CHECK_FATAL(bad == offset, "Buffer underrun of %p at offset -%u", user_ptr, (unsigned int) (offset - bad));
+}
+
+void DebugHeapDefaultConfig(DebugHeapConfig* config, size_t size)
+{
+  memset(config, 0, sizeof *config);
+  config->m_Size              = size;
+  config->m_Engine            = kDebugHeapEngineList;
+  config->m_FlushLowWatermark = size / 8;
+  config->m_GrowSize          = size;
+  config->m_MaxSegments       = 1;
+  config->m_GuardMode         = kDebugHeapGuardPages;
+}
+
+DebugHeap* DebugHeapInit(size_t mem_size_bytes)
+{
+  DebugHeapConfig config;
+  DebugHeapDefaultConfig(&config, mem_size_bytes);
+  return DebugHeapInitWithConfig(&config);
+}
+
+DebugHeap* DebugHeapInitWithConfig(const DebugHeapConfig* config)
+{
+  DebugHeap* self;
+
+  const size_t mem_page_count    = config->m_Size / kPageSize;
+  const size_t grow_page_count   = config->m_GrowSize ? config->m_GrowSize / kPageSize : mem_page_count;
+  const size_t segment_limit     = grow_page_count > mem_page_count ? grow_page_count : mem_page_count;
+  const size_t max_segments      = config->m_MaxSegments ? (config->m_MaxSegments < kMaxSegments ? config->m_MaxSegments : kMaxSegments) : 1;
+  const size_t max_allocs        = max_segments * segment_limit;
+  const DebugHeapVmBackend* vm   = config->m_VmBackend ? config->m_VmBackend : &s_PlatformVm;
+  const int platform_vm          = PlatformVmAllocate == vm->m_Allocate;
+
+  size_t slot_shift = kMinSlotShift;
+  size_t index_page_count;
+
+  size_t bitmap_word_counts[kBitmapMaxLevels];
+  size_t bitmap_level_count = 0;
+  size_t bitmap_bytes = 0;
+
+  size_t header_bytes, free_list_bytes, directory_bytes, leaves_bytes, access_bytes, blocks_bytes, packed_bytes;
+  size_t bookkeeping_bytes;
+  char* range;
+  char* cursor;
+  uint64_t* bitmap_words;
+
+  ASSERT_FATAL((platform_vm || kDebugHeapGuardRegions != config->m_GuardMode), "Guard regions need the platform backend");
+  ASSERT_FATAL((!config->m_AsyncDecommit || kDebugHeapGuardRegions != config->m_GuardMode), "Asynchronous decommit needs page protection");
+
+  // Each slot has room for the largest segment plus at least one page, so
+  // neighboring segments never look adjacent.
+  while (((size_t) 1 << slot_shift) <= segment_limit)
+    ++slot_shift;
+  index_page_count = max_segments << slot_shift;
+
+  ASSERT_FATAL(index_page_count <= 0x80000000u, "Heap too large");
+
+  // Size the bitmap levels. Each level has a bit per word in the level below.
+  // The searches start from level 1, so there are always at least two.
+  if (kDebugHeapEngineBitmap == config->m_Engine)
+  {
+    size_t entry_count = index_page_count;
+    do
+    {
+      bitmap_word_counts[bitmap_level_count] = (entry_count + 63) / 64;
+      bitmap_bytes += bitmap_word_counts[bitmap_level_count] * sizeof(uint64_t);
+      entry_count = bitmap_word_counts[bitmap_level_count++];
+    } while (entry_count > 1 || bitmap_level_count < 2);
+  }
+
+  // Every bookkeeping array starts on a page boundary so it can be committed
+  // separately. Only the linear free list needs an array; bins are threaded
+  // through the blocks. The pages themselves live in separate segments.
+  header_bytes      = RoundUpToPage(sizeof(DebugHeap));
+  free_list_bytes   = RoundUpToPage(DEBUG_HEAP_LINEAR_FREELIST ? max_allocs * sizeof(uint32_t) : 0);
+  directory_bytes   = RoundUpToPage((index_page_count >> kLookupLeafShift) * sizeof(uint32_t));
+  leaves_bytes      = max_segments * ((segment_limit + kLookupLeafPages - 1) >> kLookupLeafShift) * kLookupLeafPages * sizeof(uint32_t);
+  access_bytes      = RoundUpToPage(index_page_count / 8);
+  bitmap_bytes      = RoundUpToPage(bitmap_bytes);
+  blocks_bytes      = RoundUpToPage((max_allocs + 1) * sizeof(DebugBlockInfo));
+  packed_bytes      = RoundUpToPage(config->m_PackedMaxSize ? (max_allocs / 2 + 1) * sizeof(DebugPackedPage) : 0);
+  bookkeeping_bytes = header_bytes + free_list_bytes + directory_bytes + leaves_bytes + access_bytes + bitmap_bytes + blocks_bytes + packed_bytes;
+
+  range = (char *)VmAllocate(bookkeeping_bytes);
+  if (!range)
+  {
+    return NULL;
+  }
+
+#if DEBUG_HEAP_SSE2
+  // Every heap picks the same kernel, so racing here is harmless.
+  if (CpuHasAvx2())
+    s_FillMismatch = FillMismatchAvx2;
+#endif
+
+  // Only the header and the upper bitmap levels are committed up front. They
+  // are tiny compared to the heap, and the searches read them all over the
+  // place. Everything else is committed as the heap grows into it.
+  VmCommit(range, header_bytes);
+
+  self = (DebugHeap*) range;
+  cursor = range + header_bytes;
+
+  self->m_ReservedBytes   = bookkeeping_bytes;
+  self->m_MaxAllocs       = (uint32_t) max_allocs;
+  self->m_Engine          = config->m_Engine;
+  self->m_SlotShift       = (uint32_t) slot_shift;
+  self->m_MaxSegments     = (uint32_t) max_segments;
+  self->m_SegmentCount    = 0;
+  self->m_GrowPageCount   = (uint32_t) grow_page_count;
+  self->m_SegmentPageLimit = (uint32_t) segment_limit;
+  self->m_GranuleShift    = (uint32_t) slot_shift + 12;
+  memset(self->m_Segments, 0, sizeof self->m_Segments);
+  memset(self->m_SegmentHash, 0, sizeof self->m_SegmentHash);
+#if DEBUG_HEAP_LINEAR_FREELIST
+  self->m_FreeList        = (uint32_t*) CommitRangeInit(&self->m_FreeListCommit, &cursor, free_list_bytes);
+  self->m_FreeListSize    = 0;
+#else
+  cursor += free_list_bytes;
+  memset(self->m_FreeBinMask, 0, sizeof self->m_FreeBinMask);
+  memset(self->m_FreeBins, 0, sizeof self->m_FreeBins);
+#endif
+  self->m_LookupDirectory = (uint32_t*)       CommitRangeInit(&self->m_LookupDirectoryCommit, &cursor, directory_bytes);
+  self->m_LookupLeaves    = (uint32_t*)       CommitRangeInit(&self->m_LookupLeavesCommit, &cursor, leaves_bytes);
+  self->m_LookupLeafCount = 0;
+  self->m_AccessBits      = (uint64_t*)       cursor;
+  cursor                 += access_bytes;
+  bitmap_words            = (uint64_t*)       cursor;
+  cursor                 += bitmap_bytes;
+  self->m_Blocks          = (DebugBlockInfo*) CommitRangeInit(&self->m_BlocksCommit, &cursor, blocks_bytes);
+  self->m_PackedPages     = (DebugPackedPage*) CommitRangeInit(&self->m_PackedPagesCommit, &cursor, packed_bytes);
+  self->m_FirstUnusedBlockInfo = 0;
+  self->m_BlockInfoCount  = 1;
+  self->m_BlockInfoLiveCount = 0;
+  self->m_FreePageCount   = 0;
+  self->m_PendingListSize = 0;
+  self->m_PendingPageCount = 0;
+  self->m_PendingHead     = 0;
+  self->m_PendingTail     = 0;
+  self->m_FlushBudget     = config->m_FlushBudget;
+  self->m_FlushLowWatermark = (uint32_t) (config->m_FlushLowWatermark / kPageSize);
+  self->m_QuarantinePages = (uint32_t) ((config->m_QuarantineBytes + kPageSize - 1) / kPageSize);
+  self->m_QuarantineBlocks = config->m_QuarantineBlocks;
+  self->m_QuarantineMs    = config->m_QuarantineMilliseconds;
+  self->m_ReentrancyGuard = 0;
+  self->m_Vm              = *vm;
+  self->m_GuardRegions    = kDebugHeapGuardRegions == config->m_GuardMode ||
+                            (kDebugHeapGuardAuto == config->m_GuardMode && platform_vm && !config->m_AsyncDecommit && VmGuardSupported());
+  self->m_MappingsPerAlloc = self->m_GuardRegions ? 0 : kMappingsPerAlloc;
+  self->m_MappingCount    = kBookkeepingMappings;
+  self->m_MappingBudget   = config->m_MappingBudget;
+  self->m_MappingFailures = 0;
+  self->m_DecommitBatch   = config->m_DecommitBatch < kDecommitQueueSize ? config->m_DecommitBatch : kDecommitQueueSize;
+  self->m_DecommitCount   = 0;
+  self->m_BatchHandle     = self->m_GuardRegions && self->m_DecommitBatch > 1 ? VmBatchOpen() : -1;
+  self->m_ProtectRequests = 0;
+  self->m_ProtectCalls    = 0;
+  self->m_AccessiblePageCount = 0;
+  self->m_BodyPageCount   = 0;
+  self->m_PoisonBudgetPages = (uint32_t) (config->m_PoisonBudget / kPageSize);
+  self->m_PoisonedFrees   = 0;
+  self->m_CacheColors     = config->m_CacheColors < kCacheColorMax ? config->m_CacheColors : kCacheColorMax;
+  self->m_ColorCursor     = 0;
+  self->m_FillWindow      = (uint32_t) (config->m_FillWindow < kPageSize ? config->m_FillWindow : kPageSize);
+  self->m_TailCanary      = !!config->m_TailCanary;
+  self->m_PairedLayout    = !!config->m_PairedLayout;
+  self->m_OpenPair        = 0;
+  self->m_PackedMaxSize   = (uint32_t) (config->m_PackedMaxSize < kPackedMaxSize ? config->m_PackedMaxSize : kPackedMaxSize);
+  self->m_PackedPageCount = 0;
+  self->m_PackedSlotCount = 0;
+  memset(self->m_PackedClasses, 0, sizeof self->m_PackedClasses);
+  self->m_FirstUnusedPackedPage = 0;
+  self->m_PackedPageRecordCount = 1;
+  self->m_AsyncWaits      = 0;
+
+  // The worker only knows how to handle platform memory. If it can't be
+  // started, frees decommit right away instead, and there are no ready slots.
+  self->m_WorkerRunning   = platform_vm && (config->m_AsyncDecommit || config->m_ReadySlots) && WorkerStart(&self->m_Worker);
+  self->m_AsyncDecommit   = self->m_WorkerRunning && config->m_AsyncDecommit;
+  self->m_ReadySlots      = self->m_WorkerRunning ? config->m_ReadySlots : 0;
+  self->m_ReadyEpochRequests = 0;
+  self->m_ReadyHits       = 0;
+  self->m_ReadyMisses     = 0;
+  memset(self->m_ReadyPools, 0, sizeof self->m_ReadyPools);
+
+  // Other backends may not map anything, so they get no automatic budget.
+  if (0 == self->m_MappingBudget)
+    self->m_MappingBudget = platform_vm ? VmMappingLimit() : 0;
+  else if (~0u == self->m_MappingBudget)
+    self->m_MappingBudget = 0;
+
+  // Set up the bitmap levels. Everything starts out full, which keeps the
+  // searches out of slots without a segment. Level 0 is only committed for
+  // slots as segments are added to them.
+  self->m_BitmapLevelCount = (uint32_t) bitmap_level_count;
+  if (bitmap_bytes)
+  {
+    size_t level;
+    uint64_t* words = bitmap_words;
+
+    for (level = 0; level < bitmap_level_count; ++level)
+    {
+      self->m_BitmapWordCount[level] = (uint32_t) bitmap_word_counts[level];
+      self->m_Bitmap[level] = words;
+      words += bitmap_word_counts[level];
+    }
+
+    VmCommit(self->m_Bitmap[1], bitmap_bytes - bitmap_word_counts[0] * sizeof(uint64_t));
+    memset(self->m_Bitmap[1], 0xff, (char*) words - (char*) self->m_Bitmap[1]);
+  }
+
+  if (!AddSegment(self, (uint32_t) mem_page_count))
+  {
+    if (self->m_WorkerRunning)
+      WorkerStop(&self->m_Worker);
+    VmFree(range, bookkeeping_bytes);
+    return NULL;
+  }
+
+  return self;
+}
+
+void DebugHeapDestroy(DebugHeap* heap)
+{
+  uint32_t slot;
+
+  VmBatchClose(heap->m_BatchHandle);
+
+  if (heap->m_WorkerRunning)
+    WorkerStop(&heap->m_Worker);
+
+  for (slot = 0; slot < heap->m_MaxSegments; ++slot)
+  {
+    if (heap->m_Segments[slot].m_Base)
+      heap->m_Vm.m_Free(heap->m_Vm.m_Context, heap->m_Segments[slot].m_Base, (uint64_t) heap->m_Segments[slot].m_PageCount * kPageSize);
+  }
+
+  VmFree(heap, heap->m_ReservedBytes);
+}
+
+static DebugBlockInfo* AllocFromFreeList(DebugHeap* heap, uint32_t page_req)
+{
+  DebugBlockInfo* best_block = FreeListTakeBest(heap, page_req);
+  uint32_t best_block_size;
+
+  if (!best_block)
+    return NULL;
+
+  best_block_size = best_block->m_PageCount;
+
+  // Carve out the number of pages we need from our best block.
+  {
+    uint32_t unused_page_count = best_block_size - page_req;
+
+    if (unused_page_count > 0)
+    {
+      // Allocate a new block to keep track of the tail end.
+      DebugBlockInfo* tail_block = AllocBlockInfo(heap);
+      if (!tail_block)
+      {
+        FreeListInsert(heap, best_block);
+        return NULL;
+      }
+
+      tail_block->m_Allocated = 0;
+      tail_block->m_PendingFree = 0;
+      tail_block->m_PageIndex = best_block->m_PageIndex + best_block->m_PageCount - unused_page_count;
+      tail_block->m_PageCount = unused_page_count;
+
+      // Link it in to the chain.
+      tail_block->m_Next = best_block->m_Next;
+      tail_block->m_Prev = BlockIndexOf(heap, best_block);
+      if (tail_block->m_Next)
+        BlockAt(heap, tail_block->m_Next)->m_Prev = BlockIndexOf(heap, tail_block);
+      best_block->m_Next = BlockIndexOf(heap, tail_block);
+
+      // Add it to the free list
+      FreeListInsert(heap, tail_block);
+
+      // Patch up this block
+      best_block->m_PageCount = page_req;
+    }
+  }
+
+  return best_block;
+}
+
+static DebugBlockInfo* AllocFromBitmap(DebugHeap* heap, uint32_t page_req)
+{
+  DebugBlockInfo* block;
+  uint32_t page_index = BitmapFindRun(heap, page_req);
+
+  if (~0u == page_index)
+    return NULL;
+
+  // Blocks only track live and pending allocations here; the bitmap does the rest.
+  if (NULL == (block = AllocBlockInfo(heap)))
+    return NULL;
+
+  BitmapUpdate(heap, page_index, page_req, 1);
+  heap->m_FreePageCount -= page_req;
+
+  block->m_PageIndex = page_index;
+  block->m_PageCount = page_req;
+  block->m_Prev = 0;
+  block->m_Next = 0;
+
+  return block;
+}
+
+// The pages of a block that hold allocations: all but the trailing guard
+// page, and the leading one of a paired block.
+static uint32_t BodyPageIndex(const DebugBlockInfo* block)
+{
+  return block->m_PageIndex + block->m_Paired;
+}
+
+static uint32_t BodyPageCount(const DebugBlockInfo* block)
+{
+  return block->m_PageCount - 1 - block->m_Paired;
+}
+
+// Find room for page_req pages with the configured engine and mark it allocated.
+// Placed blocks that aren't published yet (ready slots) can't be found
+// from their address.
+static DebugBlockInfo* PlaceBlock(DebugHeap* heap, uint32_t page_req, int paired)
+{
+  DebugBlockInfo* block;
+
+  if (kDebugHeapEngineBitmap == heap->m_Engine)
+    block = AllocFromBitmap(heap, page_req);
+  else
+    block = AllocFromFreeList(heap, page_req);
+
+  if (!block)
+    return NULL;
+
+  block->m_Allocated = 1;
+  block->m_Paired = paired;
+  block->m_Packed = 0;
+  heap->m_Segments[block->m_PageIndex >> heap->m_SlotShift].m_BlockCount++;
+  heap->m_BodyPageCount += BodyPageCount(block);
+
+  if (heap->m_GuardRegions)
+    PreparePages(heap, block->m_PageIndex, block->m_PageCount);
+
+  return block;
+}
+
+// Blocks are found from the first page of their body.
+static void PublishBlock(DebugHeap* heap, DebugBlockInfo* block)
+{
+  const uint32_t first = BodyPageIndex(block);
+
+  ASSERT_FATAL(GetBlockLookup(heap, first) == NULL, "block lookup corrupted");
+  SetBlockLookup(heap, first, block);
+
+  {
+    uint32_t i, max;
+    for (i = 1, max = block->m_PageCount - block->m_Paired; i < max; ++i)
+    {
+      ASSERT_FATAL(GetBlockLookup(heap, first + i) == NULL, "block lookup corrupted");
+    }
+  }
+}
+
+static DebugBlockInfo* AllocPages(DebugHeap* heap, uint32_t page_req, int paired)
+{
+  DebugBlockInfo* block = PlaceBlock(heap, page_req, paired);
+
+  if (block)
+    PublishBlock(heap, block);
+
+  return block;
+}
+
+// Fill memory with a pattern byte. Large fills use non-temporal stores, so
+// patterns that won't be read until they're checked don't push anything
+// useful out of the cache.
+static void FillBytes(void* dest, unsigned char fill, size_t size)
+{
+#if DEBUG_HEAP_SSE2
+  if (size >= kStreamingFillSize)
+  {
+    const __m128i pattern = _mm_set1_epi8((char) fill);
+    char* ptr = (char*) dest;
+    char* end = ptr + size;
+    char* aligned = (char*) (((uintptr_t) ptr + 15) & ~(uintptr_t) 15);
+
+    memset(ptr, fill, aligned - ptr);
+
+    for (ptr = aligned; ptr + 64 <= end; ptr += 64)
+    {
+      _mm_stream_si128((__m128i*) ptr + 0, pattern);
+      _mm_stream_si128((__m128i*) ptr + 1, pattern);
+      _mm_stream_si128((__m128i*) ptr + 2, pattern);
+      _mm_stream_si128((__m128i*) ptr + 3, pattern);
+    }
+
+    memset(ptr, fill, end - ptr);
+
+    // Streaming stores are weakly ordered, and the pages may be handed to
+    // the worker thread next.
+    _mm_sfence();
+    return;
+  }
+#endif
+
+  memset(dest, fill, size);
+}
+
+// Fill the bytes in front of an allocation, of which there are offset, up
+// to the fill window.
+static void LeadingFill(const DebugHeap* heap, char* user_ptr, uint32_t offset)
+{
+  if (heap->m_FillWindow && offset > heap->m_FillWindow)
+    offset = heap->m_FillWindow;
+
+  FillBytes(user_ptr - offset, 0xfc, offset);
+}
+
+static void* FinalizeAlloc(DebugHeap* heap, DebugBlockInfo* block, size_t user_size, size_t user_alignment)
+{
+  char* ptr = PageAddress(heap, block->m_PageIndex);
+  uint32_t ideal_offset, aligned_offset;
+  uint32_t tail_slack = 0;
+
+  // Commit pages in user-accessible section.
+  PagesCommit(heap, block->m_PageIndex, block->m_PageCount - 1);
+
+  // Decommit guard page to force crashes for stepping over bounds. Free
+  // pages are never accessible, so this normally costs nothing.
+  PagesDecommit(heap, block->m_PageIndex + block->m_PageCount - 1, 1);
+
+  // Align user allocation towards end of page, respecting user alignment.
+
+  // Ideally the offset would be kPageSize - user_size % kPageSize.
+  ideal_offset = ((uint32_t)(kPageSize - user_size)) % kPageSize;
+
+  // Align down to meet user minimum alignment.
+  aligned_offset = ideal_offset & ~((uint32_t)(user_alignment-1));
+
+  // Move the start back by the next color, as far as the page allows.
+  if (heap->m_CacheColors)
+  {
+    uint32_t colors = aligned_offset / kCacheLineSize + 1;
+    uint32_t shift;
+
+    if (colors > heap->m_CacheColors)
+      colors = heap->m_CacheColors;
+
+    shift = (heap->m_ColorCursor++ % colors) * kCacheLineSize;
+    aligned_offset = (aligned_offset - shift) & ~((uint32_t)(user_alignment-1));
+  }
+
+  // Fill everything after the allocation up to the guard page with a canary.
+  if (heap->m_CacheColors || heap->m_TailCanary)
+  {
+    tail_slack = (uint32_t) ((size_t) (block->m_PageCount - 1) * kPageSize - aligned_offset - user_size);
+    FillBytes(ptr + aligned_offset + user_size, kTailCanaryByte, tail_slack);
+  }
+
+  block->m_TailSlack = tail_slack;
+
+  // Garbage fill start of page.
+  LeadingFill(heap, ptr + aligned_offset, aligned_offset);
+
+  return ptr + aligned_offset;
+}
+
+// Set up a new paired block with the allocation in its left half, and open
+// it for the next one. The left allocation is followed by a canary, and the
+// right half is poisoned until it's handed out.
+static void* FinalizePair(DebugHeap* heap, DebugBlockInfo* block, size_t user_size)
+{
+  char* ptr = PageAddress(heap, BodyPageIndex(block));
+
+  PagesDecommit(heap, block->m_PageIndex, 1);
+  PagesCommit(heap, BodyPageIndex(block), 1);
+  PagesDecommit(heap, BodyPageIndex(block) + 1, 1);
+
+  block->m_TailSlack = (uint32_t) (kPairHalfSize - user_size);
+  block->m_PairHalves = kPairLeft;
+
+  FillBytes(ptr + user_size, kTailCanaryByte, block->m_TailSlack);
+  FillBytes(ptr + kPairHalfSize, kPoisonByte, kPairHalfSize);
+
+  heap->m_OpenPair = BlockIndexOf(heap, block);
+
+  return ptr;
+}
+
+// Hand out the right half of the open pair, aligned towards the guard page.
+// Alignment slack between the allocation and the guard page gets a canary.
+static void* TakeOpenPair(DebugHeap* heap, size_t user_size, size_t user_alignment)
+{
+  DebugBlockInfo* block = BlockAt(heap, heap->m_OpenPair);
+  unsigned char* ptr = (unsigned char*) PageAddress(heap, BodyPageIndex(block));
+  uint32_t offset = ((uint32_t)(kPageSize - user_size)) & ~((uint32_t)(user_alignment-1));
+  size_t bad;
+
+  // Overruns of the left allocation that got past its canary show up here.
+  bad = FillMismatch(ptr + kPairHalfSize, kPairHalfSize, kPoisonByte);
+  CHECK_FATAL(bad == kPairHalfSize, "Buffer overrun of %p at offset %u", (void*) ptr,
+      (unsigned int) (kPairHalfSize + bad));
+
+  LeadingFill(heap, (char*) ptr + offset, offset - kPairHalfSize);
+
+  block->m_PairSlack = (uint32_t) (kPageSize - offset - user_size);
+  FillBytes(ptr + offset + user_size, kTailCanaryByte, block->m_PairSlack);
+
+  block->m_PairHalves |= kPairRight;
+  heap->m_OpenPair = 0;
+
+  return ptr + offset;
+}
+
+// Free one half of a paired block. The half is poisoned while the other one
+// is still in use. Returns non-zero if the block is now unused.
+static int ReleasePairHalf(DebugHeap* heap, DebugBlockInfo* block, void* ptr_in)
+{
+  unsigned char* ptr = (unsigned char*) PageAddress(heap, BodyPageIndex(block));
+  const uint32_t offset = (uint32_t) ((const unsigned char*) ptr_in - ptr);
+  const uint32_t half = offset < kPairHalfSize ? kPairLeft : kPairRight;
+  const unsigned char* other = half == kPairLeft ? ptr + kPairHalfSize : ptr;
+  size_t bad;
+
+  CHECK_FATAL(block->m_PairHalves & half, "Double free of %p", ptr_in);
+
+  if (kPairRight == half)
+  {
+    const unsigned char* tail = ptr + kPageSize - block->m_PairSlack;
+
+    LeadingCheck(heap, ptr_in, offset - kPairHalfSize);
+
+    bad = FillMismatch(tail, block->m_PairSlack, kTailCanaryByte);
+    CHECK_FATAL(bad == block->m_PairSlack, "Buffer overrun of %p at offset %u", ptr_in,
+        (unsigned int) (tail + bad - (const unsigned char*) ptr_in));
+  }
+  else
+  {
+    const unsigned char* tail = ptr + kPairHalfSize - block->m_TailSlack;
+
+    CHECK_FATAL(0 == offset, "Invalid pointer %p freed", ptr_in);
+
+    bad = FillMismatch(tail, block->m_TailSlack, kTailCanaryByte);
+    CHECK_FATAL(bad == block->m_TailSlack, "Buffer overrun of %p at offset %u", ptr_in,
+        (unsigned int) (tail + bad - ptr));
+
+    // The right half can't be handed out any more.
+    if (heap->m_OpenPair == BlockIndexOf(heap, block))
+      heap->m_OpenPair = 0;
+  }
+
+  block->m_PairHalves &= ~half;
+
+  if (block->m_PairHalves)
+  {
+    FillBytes(ptr + (half == kPairLeft ? 0 : kPairHalfSize), kPoisonByte, kPairHalfSize);
+    return 0;
+  }
+
+  // The other half was freed or never used, so it's still poisoned.
+  bad = FillMismatch(other, kPairHalfSize, kPoisonByte);
+  CHECK_FATAL(bad == kPairHalfSize, "Write after free at %p", (void*) (other + bad));
+
+  return 1;
+}
+
+// Slots of a class hold up to (class + 1) granules, and are followed by a
+// granule of canary.
+static uint32_t PackedStride(uint32_t size_class)
+{
+  return (size_class + 2) * kPackedGranule;
+}
+
+static uint32_t PackedSlotCount(uint32_t size_class)
+{
+  return (kPageSize - kPackedGranule) / PackedStride(size_class);
+}
+
+static DebugPackedPage* PackedPageOf(const DebugHeap* heap, const DebugBlockInfo* block)
+{
+  return &heap->m_PackedPages[block->m_PackedPage];
+}
+
+// Record index zero means "no page", so the pool starts at one.
+static uint32_t PackedPageAlloc(DebugHeap* heap)
+{
+  uint32_t index = heap->m_FirstUnusedPackedPage;
+
+  if (index)
+  {
+    heap->m_FirstUnusedPackedPage = heap->m_PackedPages[index].m_PartialNext;
+  }
+  else
+  {
+    ASSERT_FATAL(heap->m_PackedPageRecordCount <= heap->m_MaxAllocs / 2, "Packed page records exhausted");
+    index = heap->m_PackedPageRecordCount++;
+    CommitRangeGrow(&heap->m_PackedPagesCommit, (index + (size_t) 1) * sizeof(DebugPackedPage));
+  }
+
+  memset(&heap->m_PackedPages[index], 0, sizeof(DebugPackedPage));
+  return index;
+}
+
+static void PackedPageFree(DebugHeap* heap, uint32_t index)
+{
+  heap->m_PackedPages[index].m_PartialNext = heap->m_FirstUnusedPackedPage;
+  heap->m_FirstUnusedPackedPage = index;
+}
+
+static void PackedPartialPush(DebugHeap* heap, DebugPackedClass* size_class, uint32_t index)
+{
+  DebugPackedPage* page = &heap->m_PackedPages[index];
+
+  page->m_PartialPrev = size_class->m_PartialTail;
+  page->m_PartialNext = 0;
+
+  if (size_class->m_PartialTail)
+    heap->m_PackedPages[size_class->m_PartialTail].m_PartialNext = index;
+  else
+    size_class->m_PartialHead = index;
+
+  size_class->m_PartialTail = index;
+}
+
+static void PackedPartialRemove(DebugHeap* heap, DebugPackedClass* size_class, uint32_t index)
+{
+  DebugPackedPage* page = &heap->m_PackedPages[index];
+
+  if (page->m_PartialPrev)
+    heap->m_PackedPages[page->m_PartialPrev].m_PartialNext = page->m_PartialNext;
+  else
+    size_class->m_PartialHead = page->m_PartialNext;
+
+  if (page->m_PartialNext)
+    heap->m_PackedPages[page->m_PartialNext].m_PartialPrev = page->m_PartialPrev;
+  else
+    size_class->m_PartialTail = page->m_PartialPrev;
+}
+
+// Take a free slot from a packed page that has one, making sure it hasn't
+// been written to since it was freed. Unused bytes at the end of the slot
+// become part of its canary.
+static void* PackedTakeSlot(DebugHeap* heap, DebugBlockInfo* block, size_t user_size)
+{
+  DebugPackedPage* page = PackedPageOf(heap, block);
+  const uint32_t stride = PackedStride(page->m_Class);
+  const uint32_t capacity = stride - kPackedGranule;
+  const uint32_t count = PackedSlotCount(page->m_Class);
+  uint32_t slot = page->m_Cursor;
+  unsigned char* ptr;
+  size_t bad;
+
+  // Slots are reused round-robin, so freed ones stay poisoned for as long
+  // as possible.
+  while (page->m_Used[slot / 64] & ((uint64_t) 1 << (slot % 64)))
+    slot = slot + 1 < count ? slot + 1 : 0;
+
+  ptr = (unsigned char*) PageAddress(heap, block->m_PageIndex) + kPackedGranule + slot * stride;
+
+  bad = FillMismatch(ptr, capacity, kPoisonByte);
+  CHECK_FATAL(bad == capacity, "Write after free at %p", (void*) (ptr + bad));
+
+  memset(ptr + user_size, kSlotCanaryByte, capacity - user_size);
+
+  page->m_Used[slot / 64] |= (uint64_t) 1 << (slot % 64);
+  page->m_UsedCount++;
+  page->m_Sizes[slot] = (uint8_t) user_size;
+  page->m_Cursor = (uint8_t) (slot + 1 < count ? slot + 1 : 0);
+  heap->m_PackedSlotCount++;
+
+  return ptr;
+}
+
+// Serve a tiny allocation from its class's current page, or failing that
+// the oldest page with free slots. Returns NULL if a new page is needed.
+static void* PackedAllocate(DebugHeap* heap, size_t user_size)
+{
+  const uint32_t class_index = (uint32_t) ((user_size - 1) / kPackedGranule);
+  DebugPackedClass* size_class = &heap->m_PackedClasses[class_index];
+
+  if (!size_class->m_Current || heap->m_PackedPages[size_class->m_Current].m_UsedCount == PackedSlotCount(class_index))
+  {
+    if (!size_class->m_PartialHead)
+      return NULL;
+
+    size_class->m_Current = size_class->m_PartialHead;
+    PackedPartialRemove(heap, size_class, size_class->m_Current);
+  }
+
+  return PackedTakeSlot(heap, BlockAt(heap, heap->m_PackedPages[size_class->m_Current].m_Block), user_size);
+}
+
+// Turn a freshly placed block into its class's current packed page: canary
+// everywhere, with poisoned slots.
+static void* PackedPageStart(DebugHeap* heap, DebugBlockInfo* block, size_t user_size)
+{
+  const uint32_t class_index = (uint32_t) ((user_size - 1) / kPackedGranule);
+  const uint32_t index = PackedPageAlloc(heap);
+  const uint32_t stride = PackedStride(class_index);
+  const uint32_t count = PackedSlotCount(class_index);
+  char* ptr = PageAddress(heap, block->m_PageIndex);
+  DebugPackedPage* page = &heap->m_PackedPages[index];
+  uint32_t slot;
+
+  page->m_Block = BlockIndexOf(heap, block);
+  page->m_Class = (uint8_t) class_index;
+
+  PagesCommit(heap, block->m_PageIndex, 1);
+  PagesDecommit(heap, block->m_PageIndex + 1, 1);
+
+  FillBytes(ptr, kSlotCanaryByte, kPageSize);
+  for (slot = 0; slot < count; ++slot)
+    memset(ptr + kPackedGranule + slot * stride, kPoisonByte, stride - kPackedGranule);
+
+  block->m_Packed = 1;
+  block->m_PackedPage = index;
+  block->m_TailSlack = 0;
+  heap->m_PackedClasses[class_index].m_Current = index;
+  heap->m_PackedPageCount++;
+
+  return PackedTakeSlot(heap, block, user_size);
+}
+
+static uint32_t PackedSlotOf(const DebugHeap* heap, const DebugBlockInfo* block, const void* ptr_in)
+{
+  const DebugPackedPage* page = PackedPageOf(heap, block);
+  const uint32_t stride = PackedStride(page->m_Class);
+  const uint32_t offset = (uint32_t) ((const char*) ptr_in - PageAddress(heap, block->m_PageIndex)) - kPackedGranule;
+  const uint32_t slot = offset / stride;
+
+  CHECK_FATAL(0 == offset % stride && slot < PackedSlotCount(page->m_Class), "Invalid pointer %p", ptr_in);
+  CHECK_FATAL(page->m_Used[slot / 64] & ((uint64_t) 1 << (slot % 64)), "Double free of %p", ptr_in);
+
+  return slot;
+}
+
+// Free a packed slot after checking the canaries on either side, and poison
+// it. Returns non-zero if the page is now unused.
+static int ReleasePackedSlot(DebugHeap* heap, DebugBlockInfo* block, void* ptr_in)
+{
+  DebugPackedPage* page = PackedPageOf(heap, block);
+  DebugPackedClass* size_class = &heap->m_PackedClasses[page->m_Class];
+  const uint32_t capacity = PackedStride(page->m_Class) - kPackedGranule;
+  const uint32_t count = PackedSlotCount(page->m_Class);
+  const uint32_t slot = PackedSlotOf(heap, block, ptr_in);
+  const uint32_t size = page->m_Sizes[slot];
+  unsigned char* ptr = (unsigned char*) ptr_in;
+  size_t bad;
+
+  bad = FillMismatch(ptr - kPackedGranule, kPackedGranule, kSlotCanaryByte);
+  CHECK_FATAL(bad == kPackedGranule, "Buffer underrun of %p at offset -%u", ptr_in, (unsigned int) (kPackedGranule - bad));
+
+  bad = FillMismatch(ptr + size, capacity + kPackedGranule - size, kSlotCanaryByte);
+  CHECK_FATAL(bad == capacity + kPackedGranule - size, "Buffer overrun of %p at offset %u", ptr_in, (unsigned int) (size + bad));
+
+  memset(ptr, kPoisonByte, capacity);
+
+  page->m_Used[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+  page->m_UsedCount--;
+  heap->m_PackedSlotCount--;
+
+  if (size_class->m_Current == block->m_PackedPage)
+    return 0;
+
+  // Pages that were full go on the partial list, and pages that are empty
+  // come off it and are retired like any other block.
+  if (0 == page->m_UsedCount)
+  {
+    PackedPartialRemove(heap, size_class, block->m_PackedPage);
+    PackedPageFree(heap, block->m_PackedPage);
+    block->m_PackedPage = 0;
+    heap->m_PackedPageCount--;
+    return 1;
+  }
+
+  if (page->m_UsedCount + 1u == count)
+    PackedPartialPush(heap, size_class, block->m_PackedPage);
+
+  return 0;
+}
+
+static void PendingListPush(DebugHeap* heap, DebugBlockInfo* block)
+{
+  uint32_t index = BlockIndexOf(heap, block);
+
+  block->m_ListPrev = heap->m_PendingTail;
+  block->m_ListNext = 0;
+
+  if (heap->m_PendingTail)
+    BlockAt(heap, heap->m_PendingTail)->m_ListNext = index;
+  else
+    heap->m_PendingHead = index;
+
+  heap->m_PendingTail = index;
+  heap->m_PendingListSize++;
+  heap->m_PendingPageCount += block->m_PageCount;
+}
+
+static DebugBlockInfo* PendingListPop(DebugHeap* heap)
+{
+  DebugBlockInfo* block = BlockAt(heap, heap->m_PendingHead);
+
+  if (block)
+  {
+    heap->m_PendingHead = block->m_ListNext;
+    if (heap->m_PendingHead)
+      BlockAt(heap, heap->m_PendingHead)->m_ListPrev = 0;
+    else
+      heap->m_PendingTail = 0;
+
+    block->m_ListPrev = 0;
+    block->m_ListNext = 0;
+    heap->m_PendingListSize--;
+    heap->m_PendingPageCount -= block->m_PageCount;
+  }
+
+  return block;
+}
+
+// Give a block that has left the pending list back to the list engine,
+// coalescing it with free neighbors. Returns the resulting free block.
+static DebugBlockInfo* CoalesceBlock(DebugHeap* heap, DebugBlockInfo* block)
+{
+  DebugBlockInfo* prev;
+  DebugBlockInfo* next;
+
+  // Attempt to merge into an adjacent block to the left.
+  // We can only merge with blocks that are free and not on the pending list.
+  if (NULL != (prev = BlockAt(heap, block->m_Prev)))
+  {
+    if (!prev->m_Allocated && !prev->m_PendingFree && prev->m_PageIndex + prev->m_PageCount == block->m_PageIndex)
+    {
+      // The left neighbor changes size, so it has to come off the free list for now.
+      FreeListRemove(heap, prev);
+
+      // Linked list setup.
+      prev->m_Next = block->m_Next;
+
+      if (block->m_Next)
+        BlockAt(heap, block->m_Next)->m_Prev = block->m_Prev;
+
+      // Increase size of left neighbor.
+      prev->m_PageCount += block->m_PageCount;
+
+      // Kill this pending block.
+      FreeBlockInfo(heap, block);
+
+      // Attempt to do right side coalescing with this other block instead.
+      block = prev;
+    }
+  }
+
+  // Attempt to merge into an adjacent block to the right.
+  if (NULL != (next = BlockAt(heap, block->m_Next)))
+  {
+    if (!next->m_Allocated && !next->m_PendingFree && next->m_PageIndex == block->m_PageIndex + block->m_PageCount)
+    {
+      FreeListRemove(heap, next);
+
+      // Linked list setup.
+      block->m_Next = next->m_Next;
+      if (block->m_Next)
+        BlockAt(heap, block->m_Next)->m_Prev = BlockIndexOf(heap, block);
+      block->m_PageCount += next->m_PageCount;
+
+      // Free the R neighbor block now that we're done with it.
+      FreeBlockInfo(heap, next);
+    }
+  }
+
+  // This block (or the left neighbor it was merged into) goes on the free list.
+  block->m_PendingFree = 0;
+  FreeListInsert(heap, block);
+
+  return block;
+}
+
+// Coalesce up to max_blocks pending frees back into the free pages, oldest first.
+// Make sure a poisoned block hasn't been written to since it was freed.
+static void PoisonCheck(const DebugHeap* heap, const DebugBlockInfo* block)
+{
+  const unsigned char* bytes = (const unsigned char*) PageAddress(heap, BodyPageIndex(block));
+  const size_t size = (size_t) BodyPageCount(block) * kPageSize;
+  size_t bad = FillMismatch(bytes, size, kPoisonByte);
+
+  CHECK_FATAL(bad == size, "Write after free at %p", (void*) (bytes + bad));
+}
+
+static void FlushPendingFrees(DebugHeap* heap, uint32_t max_blocks)
+{
+  DebugBlockInfo* block;
+
+  while (max_blocks-- > 0 && NULL != (block = PendingListPop(heap)))
+  {
+    uint32_t slot = block->m_PageIndex >> heap->m_SlotShift;
+
+    // The block is about to be reused, so it must be inaccessible first.
+    if (DecommitQueued(heap, block))
+      FlushDecommits(heap);
+
+    // Decommitted blocks are inaccessible by now, so an accessible one was
+    // poisoned. Check it, then keep its pages committed for reuse unless
+    // there are too many poisoned pages about.
+    if (BodyPageCount(block) && PageAccessible(heap, BodyPageIndex(block)))
+    {
+      PoisonCheck(heap, block);
+      if (PoisonedPageCount(heap) > heap->m_PoisonBudgetPages)
+        PagesDecommit(heap, BodyPageIndex(block), BodyPageCount(block));
+    }
+    else if (heap->m_AsyncDecommit)
+    {
+      WorkerWait(heap, block->m_WorkTicket);
+    }
+
+    if (kDebugHeapEngineBitmap == heap->m_Engine)
+    {
+      // Clearing the bits is all the coalescing the bitmap needs.
+      BitmapUpdate(heap, block->m_PageIndex, block->m_PageCount, 0);
+      heap->m_FreePageCount += block->m_PageCount;
+      FreeBlockInfo(heap, block);
+      block = NULL;
+    }
+    else
+    {
+      block = CoalesceBlock(heap, block);
+    }
+
+    // Segments added by growing the heap go back to the OS once nothing in
+    // them is allocated or pending.
+    if (0 == --heap->m_Segments[slot].m_BlockCount && 0 != slot)
+      ReleaseSegment(heap, slot, block);
+  }
+}
+
+static int PendingListOverLimit(DebugHeap* heap)
+{
+  const DebugBlockInfo* oldest = BlockAt(heap, heap->m_PendingHead);
+
+  if (!oldest)
+    return 0;
+
+  if (heap->m_QuarantinePages && heap->m_PendingPageCount > heap->m_QuarantinePages)
+    return 1;
+
+  if (heap->m_QuarantineBlocks && heap->m_PendingListSize > heap->m_QuarantineBlocks)
+    return 1;
+
+  if (heap->m_QuarantineMs && TimeNowMs() - oldest->m_FreeTime > heap->m_QuarantineMs)
+    return 1;
+
+  return 0;
+}
+
+// Called on every allocation and free to keep the pending list in check.
+// Does at most m_FlushBudget blocks worth of coalescing, if a budget is set.
+static void UpdatePendingFrees(DebugHeap* heap)
+{
+  uint32_t budget = heap->m_FlushBudget ? heap->m_FlushBudget : ~0u;
+
+  // Evict the oldest blocks while the pending list is over its limits.
+  while (budget > 0 && PendingListOverLimit(heap))
+  {
+    FlushPendingFrees(heap, 1);
+    --budget;
+  }
+
+  // Spread coalescing work out over allocations and frees once free pages run low.
+  if (heap->m_FlushBudget && heap->m_FreePageCount < heap->m_FlushLowWatermark)
+  {
+    FlushPendingFrees(heap, budget);
+  }
+}
+
+// Put a block that is no longer in use on the pending list.
+static void RetireBlock(DebugHeap* heap, DebugBlockInfo* block)
+{
+  const uint32_t body_pages = BodyPageCount(block);
+
+  block->m_Allocated = 0;
+  block->m_PendingFree = 1;
+  heap->m_BodyPageCount -= body_pages;
+
+  if (body_pages && PoisonedPageCount(heap) <= heap->m_PoisonBudgetPages)
+  {
+    // Under the poison budget, keep the pages and fill them instead. Writes
+    // after free are caught when the block leaves the pending list, but
+    // reads go unnoticed.
+    FillBytes(PageAddress(heap, BodyPageIndex(block)), kPoisonByte, (size_t) body_pages * kPageSize);
+    heap->m_PoisonedFrees++;
+  }
+  else
+  {
+    // Protect these blocks from reading or writing completely by decommiting the
+    // pages, either right away or with the next batch.
+    QueueDecommit(heap, block);
+  }
+  heap->m_MappingCount -= heap->m_MappingsPerAlloc;
+
+  // Add the block to the pending free list. This may coalesce it right away
+  // if the pending list is over its limits, so do it last.
+  block->m_FreeTime = TimeNowMs();
+  PendingListPush(heap, block);
+}
+
+// Carve slots for a pool until it reaches its target, a few at a time. The
+// worker commits them in the background.
+static void ReadyPoolRefill(DebugHeap* heap, DebugReadyPool* pool, uint32_t page_req)
+{
+  uint32_t n;
+
+  for (n = 0; n < kReadyRefillPerCall && pool->m_Count < pool->m_Target; ++n)
+  {
+    DebugBlockInfo* block;
+    uint32_t page_index, page_count;
+
+    if (heap->m_MappingBudget && heap->m_MappingCount + heap->m_MappingsPerAlloc > heap->m_MappingBudget)
+      return;
+
+    if (NULL == (block = PlaceBlock(heap, page_req, 0)))
+      return;
+
+    heap->m_MappingCount += heap->m_MappingsPerAlloc;
+
+    // The guard page is normally inaccessible already, unless a poisoned
+    // block left it committed.
+    PagesDecommit(heap, block->m_PageIndex + block->m_PageCount - 1, 1);
+
+    page_index = block->m_PageIndex;
+    page_count = block->m_PageCount - 1;
+    block->m_WorkTicket = heap->m_Worker.m_Issued;
+
+    heap->m_ProtectRequests++;
+    if (PagesTrim(heap, &page_index, &page_count, 1))
+      block->m_WorkTicket = WorkerSubmit(&heap->m_Worker, heap->m_GuardRegions ? kWorkGuardRemove : kWorkCommit, PageAddress(heap, page_index), (uint64_t) page_count * kPageSize);
+
+    pool->m_Slots[(pool->m_Head + pool->m_Count++) % kReadyPoolCapacity] = BlockIndexOf(heap, block);
+  }
+}
+
+// Take the oldest slot of a pool, if the worker has committed it.
+static DebugBlockInfo* ReadyPoolTake(DebugHeap* heap, DebugReadyPool* pool)
+{
+  DebugBlockInfo* block;
+
+  if (0 == pool->m_Count)
+    return NULL;
+
+  block = BlockAt(heap, pool->m_Slots[pool->m_Head]);
+  if (!WorkerDone(&heap->m_Worker, block->m_WorkTicket))
+    return NULL;
+
+  pool->m_Head = (pool->m_Head + 1) % kReadyPoolCapacity;
+  pool->m_Count--;
+  return block;
+}
+
+// Give a pool's oldest slot back to the heap, as if it had been freed.
+static void ReadyPoolRelease(DebugHeap* heap, DebugReadyPool* pool)
+{
+  DebugBlockInfo* block = BlockAt(heap, pool->m_Slots[pool->m_Head]);
+
+  pool->m_Head = (pool->m_Head + 1) % kReadyPoolCapacity;
+  pool->m_Count--;
+
+  WorkerWait(heap, block->m_WorkTicket);
+  RetireBlock(heap, block);
+}
+
+// Count an allocation against its pool. At the end of an epoch, the slot
+// budget is shared out again by demand, and pools over their new target
+// give the surplus back.
+static void ReadyPoolCount(DebugHeap* heap, DebugReadyPool* pool, int hit)
+{
+  uint32_t i;
+
+  pool->m_Requests++;
+
+  if (hit)
+  {
+    heap->m_ReadyHits++;
+  }
+  else
+  {
+    heap->m_ReadyMisses++;
+
+    // Start a pool on its first miss rather than at the end of the epoch.
+    if (0 == pool->m_Target)
+      pool->m_Target = 1;
+  }
+
+  if (++heap->m_ReadyEpochRequests < kReadyEpochLength)
+    return;
+
+  heap->m_ReadyEpochRequests = 0;
+
+  for (i = 0; i < kReadyPoolCount; ++i)
+  {
+    DebugReadyPool* p = &heap->m_ReadyPools[i];
+    uint64_t target = ((uint64_t) heap->m_ReadySlots * p->m_Requests + kReadyEpochLength - 1) / kReadyEpochLength;
+
+    p->m_Target = target < kReadyPoolCapacity ? (uint32_t) target : kReadyPoolCapacity;
+    p->m_Requests = 0;
+
+    while (p->m_Count > p->m_Target)
+      ReadyPoolRelease(heap, p);
+  }
+}
+
+// Give back every ready slot. Returns zero if there were none.
+static int ReadyPoolsDrain(DebugHeap* heap)
+{
+  uint32_t i;
+  int released = 0;
+
+  for (i = 0; i < kReadyPoolCount; ++i)
+  {
+    DebugReadyPool* pool = &heap->m_ReadyPools[i];
+
+    pool->m_Target = 0;
+    while (pool->m_Count)
+    {
+      ReadyPoolRelease(heap, pool);
+      released = 1;
+    }
+  }
+
+  return released;
+}
+
+void* DebugHeapAllocate(DebugHeap* heap, size_t size, size_t alignment)
+{
+  DebugBlockInfo* block;
+  DebugReadyPool* pool = NULL;
+  uint32_t page_req;
+  int packed, paired;
+  void* result;
+
+  DEBUG_THREAD_GUARD_ENTER(heap);
+
+  // Figure out how many pages we're going to need.
+  // Always increment by one so we have room for a guard page at the end.
+  page_req = 1 + (uint32_t) ((size + kPageSize - 1) / kPageSize);
+
+  UpdatePendingFrees(heap);
+
+  // Tiny allocations are packed into shared pages when possible.
+  packed = size > 0 && size <= heap->m_PackedMaxSize && alignment <= kPackedGranule;
+
+  if (packed)
+  {
+    page_req = 2;
+
+    if (NULL != (result = PackedAllocate(heap, size)))
+    {
+      DEBUG_THREAD_GUARD_LEAVE(heap);
+      return result;
+    }
+  }
+
+  // Small allocations share paired blocks, two to a block.
+  paired = !packed && heap->m_PairedLayout && size > 0 && size + alignment <= kPairHalfSize;
+
+  if (paired)
+  {
+    page_req = kPairPageCount;
+
+    if (heap->m_OpenPair)
+    {
+      result = TakeOpenPair(heap, size, alignment);
+      DEBUG_THREAD_GUARD_LEAVE(heap);
+      return result;
+    }
+  }
+
+  // Small allocations are served from the ready pools when possible.
+  else if (!packed && heap->m_ReadySlots && page_req - 2 < kReadyPoolCount)
+  {
+    pool = &heap->m_ReadyPools[page_req - 2];
+    block = ReadyPoolTake(heap, pool);
+    ReadyPoolCount(heap, pool, NULL != block);
+
+    if (block)
+    {
+      PublishBlock(heap, block);
+      result = FinalizeAlloc(heap, block, size, alignment);
+      ReadyPoolRefill(heap, pool, page_req);
+      DEBUG_THREAD_GUARD_LEAVE(heap);
+      return result;
+    }
+  }
+
+  // Past the mapping budget, the mprotect() calls below would fail. Freeing
+  // live allocations is the only way back, so fail the allocation cleanly.
+  if (heap->m_MappingBudget && heap->m_MappingCount + heap->m_MappingsPerAlloc > heap->m_MappingBudget)
+  {
+    heap->m_MappingFailures++;
+    DEBUG_THREAD_GUARD_LEAVE(heap);
+    return NULL;
+  }
+
+  for (;;)
+  {
+    if (NULL != (block = AllocPages(heap, page_req, paired)))
+    {
+      if (packed)
+        result = PackedPageStart(heap, block, size);
+      else if (paired)
+        result = FinalizePair(heap, block, size);
+      else
+        result = FinalizeAlloc(heap, block, size, alignment);
+      heap->m_MappingCount += heap->m_MappingsPerAlloc;
+      if (pool)
+        ReadyPoolRefill(heap, pool, page_req);
+      DEBUG_THREAD_GUARD_LEAVE(heap);
+      return result;
+    }
+
+    // Grow the heap before recycling pending frees, so they stay under
+    // observation for as long as possible.
+    if (GrowHeap(heap, page_req))
+      continue;
+
+    // Ready slots are given back as a last resort.
+    if (!heap->m_PendingHead)
+    {
+      if (ReadyPoolsDrain(heap))
+        continue;
+      break;
+    }
+
+    // We couldn't find a block off the free list. Consolidate pending frees,
+    // a budget's worth at a time so we stop as soon as the allocation fits.
+    FlushPendingFrees(heap, heap->m_FlushBudget ? heap->m_FlushBudget : ~0u);
+  }
+
+  // Out of memory.
+  DEBUG_THREAD_GUARD_LEAVE(heap);
+  return NULL;
+}
+
+void DebugHeapFree(DebugHeap* heap, void* ptr_in)
+{
+  uint32_t        page_index;
+  DebugBlockInfo *block;
+
+  DEBUG_THREAD_GUARD_ENTER(heap);
+
+  // Figure out what page this belongs to.
+  CHECK_FATAL(PageIndexOf(heap, ptr_in, &page_index), "Pointer %p not owned by heap", ptr_in);
+
+  block = GetBlockLookup(heap, page_index);
+
+  CHECK_FATAL(block, "Double free of %p", ptr_in);
+
+  ASSERT_FATAL((uint32_t)block->m_Allocated, "Block state corrupted");
+  ASSERT_FATAL(!block->m_PendingFree, "Block state corrupted");
+
+  // Packed pages and paired blocks are retired with their last allocation.
+  if (block->m_Packed)
+  {
+    if (!ReleasePackedSlot(heap, block, ptr_in))
+    {
+      UpdatePendingFrees(heap);
+      DEBUG_THREAD_GUARD_LEAVE(heap);
+      return;
+    }
+  }
+  else if (block->m_Paired)
+  {
+    if (!ReleasePairHalf(heap, block, ptr_in))
+    {
+      UpdatePendingFrees(heap);
+      DEBUG_THREAD_GUARD_LEAVE(heap);
+      return;
+    }
+  }
+
+  // Underruns land in the fill pattern in front of the allocation, and
+  // overruns that stop short of the guard page in the tail canary.
+  else
+  {
+    LeadingCheck(heap, ptr_in, (uint32_t) ((uintptr_t) ptr_in % kPageSize));
+
+    if (block->m_TailSlack)
+    {
+      const unsigned char* guard = (const unsigned char*) PageAddress(heap, block->m_PageIndex + block->m_PageCount - 1);
+      const unsigned char* tail = guard - block->m_TailSlack;
+      size_t bad = FillMismatch(tail, block->m_TailSlack, kTailCanaryByte);
+
+      CHECK_FATAL(bad == block->m_TailSlack, "Buffer overrun of %p at offset %u", ptr_in,
+          (unsigned int) (tail + bad - (const unsigned char*) ptr_in));
+    }
+  }
+
+  // Zero out this block in the lookup to catch double frees.
+  SetBlockLookup(heap, page_index, NULL);
+
+  {
+    uint32_t i, max;
+    for (i = 1, max = block->m_PageCount - block->m_Paired; i < max; ++i)
+    {
+      ASSERT_FATAL(GetBlockLookup(heap, page_index + i) == NULL, "block lookup corrupted");
+    }
+  }
+
+  RetireBlock(heap, block);
+
+  UpdatePendingFrees(heap);
+
+  DEBUG_THREAD_GUARD_LEAVE(heap);
+}
+
+size_t DebugHeapGetAllocSize(DebugHeap* heap, void* ptr_in)
+{
+  uintptr_t ptr;
+  uint32_t page_index;
+  size_t result;
+  DebugBlockInfo* block;
+
+  DEBUG_THREAD_GUARD_ENTER(heap);
+
+  // Figure out what page this belongs to.
+  ptr = (uintptr_t) ptr_in;
 
-        // Attempt to do right side coalescing with this other block instead.
-        block = prev;
+  CHECK_FATAL(PageIndexOf(heap, ptr_in, &page_index), "Pointer %p not owned by heap", ptr_in);
 
-        // Don't try to delete this block later - we've already done that.
-        block_removed = 1;
-      }
-    }
+  block = GetBlockLookup(heap, page_index);
 
-    // Attempt to merge into an adjacent block to the right.
-    if (NULL != (next = block->m_Next))
-    {
-      if (!next->m_Allocated && !next->m_PendingFree && next->m_PageIndex == block->m_PageIndex + block->m_PageCount)
-      {
-        uint32_t fi, fcount;
-        // Linked list setup.
-        block->m_Next = next->m_Next;
-        if (block->m_Next)
-          block->m_Next->m_Prev = block;
-        block->m_PageCount += next->m_PageCount;
-
-        // Find this thing on the free list and remove it. This is slow.
-        for (fi = 0, fcount = heap->m_FreeListSize; fi < fcount; ++fi)
-        {
-          if (heap->m_FreeList[fi] == next)
-          {
-            heap->m_FreeList[fi] = heap->m_FreeList[heap->m_FreeListSize-1];
-            --heap->m_FreeListSize;
-            break;
-          }
-        }
+  CHECK_FATAL(block, "Invalid pointer %p", ptr_in);
 
-        // Free the R neighbor block now that we're done with it.
-        FreeBlockInfo(heap, next);
-      }
-    }
+  if (block->m_Packed)
+    result = PackedPageOf(heap, block)->m_Sizes[PackedSlotOf(heap, block, ptr_in)];
+  else if (block->m_Paired && ptr % kPageSize < kPairHalfSize)
+    result = kPairHalfSize - block->m_TailSlack;
+  else if (block->m_Paired)
+    result = kPageSize - ptr % kPageSize - block->m_PairSlack;
+  else
+    result = (block->m_PageCount - 1) * kPageSize - ptr % kPageSize - block->m_TailSlack;
+
+  DEBUG_THREAD_GUARD_LEAVE(heap);
+
+  return result;
+}
+
+int DebugHeapOwns(DebugHeap* heap, void* buffer)
+{
+  uint32_t page_index;
+  int status;
+
+  DEBUG_THREAD_GUARD_ENTER(heap);
+
+  status = PageIndexOf(heap, buffer, &page_index);
+
+  DEBUG_THREAD_GUARD_LEAVE(heap);
+  return status;
+}
+
+void DebugHeapSetPoisonBudget(DebugHeap* heap, size_t bytes)
+{
+  DEBUG_THREAD_GUARD_ENTER(heap);
+  heap->m_PoisonBudgetPages = (uint32_t) (bytes / kPageSize);
+  DEBUG_THREAD_GUARD_LEAVE(heap);
+}
 
-    if (!block_removed)
+void DebugHeapGetStats(DebugHeap* heap, DebugHeapStats* stats)
+{
+  uint32_t i;
+
+  DEBUG_THREAD_GUARD_ENTER(heap);
+
+  stats->m_FreeBytes               = (size_t) heap->m_FreePageCount * kPageSize;
+  stats->m_PendingBytes            = (size_t) heap->m_PendingPageCount * kPageSize;
+  stats->m_PendingBlocks           = heap->m_PendingListSize;
+  stats->m_SegmentCount            = heap->m_SegmentCount;
+  stats->m_GuardRegions            = heap->m_GuardRegions;
+  stats->m_MappingCount            = heap->m_MappingCount;
+  stats->m_MappingBudget           = heap->m_MappingBudget;
+  stats->m_MappingFailures         = heap->m_MappingFailures;
+  stats->m_ProtectRequests         = heap->m_ProtectRequests;
+  stats->m_ProtectCalls            = heap->m_ProtectCalls;
+  stats->m_AsyncWaits              = heap->m_AsyncWaits;
+
+  if (heap->m_WorkerRunning)
+  {
+    MutexLock(&heap->m_Worker.m_Lock);
+    stats->m_AsyncPending          = heap->m_Worker.m_Issued - (uint32_t) heap->m_Worker.m_Completed;
+    stats->m_AsyncCalls            = heap->m_Worker.m_Calls;
+    MutexUnlock(&heap->m_Worker.m_Lock);
+  }
+  else
+  {
+    stats->m_AsyncPending          = 0;
+    stats->m_AsyncCalls            = 0;
+  }
+
+  stats->m_PoisonedBytes           = (size_t) PoisonedPageCount(heap) * kPageSize;
+  stats->m_PoisonBudget            = (size_t) heap->m_PoisonBudgetPages * kPageSize;
+  stats->m_PoisonedFrees           = heap->m_PoisonedFrees;
+  stats->m_PackedPageCount         = heap->m_PackedPageCount;
+  stats->m_PackedSlotCount         = heap->m_PackedSlotCount;
+  stats->m_ReadyHits               = heap->m_ReadyHits;
+  stats->m_ReadyMisses             = heap->m_ReadyMisses;
+  stats->m_ReadySlotCount          = 0;
+  for (i = 0; i < kReadyPoolCount; ++i)
+    stats->m_ReadySlotCount       += heap->m_ReadyPools[i].m_Count;
+  stats->m_BlockInfoCount          = heap->m_BlockInfoLiveCount;
+  stats->m_BlockInfoHighWater      = heap->m_BlockInfoCount - 1;
+  stats->m_BlockInfoCommittedBytes = heap->m_BlocksCommit.m_CommittedBytes;
+
+  DEBUG_THREAD_GUARD_LEAVE(heap);
+}
+
+const DebugHeapVmBackend* DebugHeapPlatformVmBackend(void)
+{
+  return &s_PlatformVm;
+}
+
+//-----------------------------------------------------------------------------
+// Simulated virtual memory
+
+// A reservation made through the simulated backend. Residency is a bit per
+// page, stored in an extra page range past the end of the reservation.
+typedef struct DebugSimulatedRegion
+{
+  char*            m_Base;
+  size_t           m_Size;
+  uint64_t*        m_Resident;
+} DebugSimulatedRegion;
+
+struct DebugHeapSimulatedVm
+{
+  DebugHeapVmBackend   m_Backend;
+  DebugSimulatedRegion m_Regions[kMaxSegments];
+  uint32_t             m_LastRegion;
+  size_t               m_ReservedBytes;
+  size_t               m_CommittedBytes;
+  size_t               m_PeakCommittedBytes;
+  uint32_t             m_CommitCalls;
+  uint32_t             m_DecommitCalls;
+};
+
+static DebugSimulatedRegion* SimulatedFindRegion(DebugHeapSimulatedVm* vm, const char* ptr)
+{
+  uint32_t i;
+
+  for (i = 0; i < kMaxSegments; ++i)
+  {
+    uint32_t slot = (vm->m_LastRegion + i) % kMaxSegments;
+    DebugSimulatedRegion* region = &vm->m_Regions[slot];
+
+    if (region->m_Base && ptr >= region->m_Base && ptr < region->m_Base + region->m_Size)
     {
-      // This block goes on the free list.
-      block->m_PendingFree = 0;
-      heap->m_FreeList[heap->m_FreeListSize++] = block;
+      vm->m_LastRegion = slot;
+      return region;
     }
   }
 
-  heap->m_PendingListSize = 0;
+  ASSERT_FATAL(0, "address not in a simulated region");
+  return NULL;
 }
 
-void* DebugHeapAllocate(DebugHeap* heap, size_t size, size_t alignment)
+// Set or clear the residency bits for a range, returning how many changed.
+static size_t SimulatedSetResident(DebugSimulatedRegion* region, const char* ptr, size_t size, int resident)
 {
-  void* ptr;
-  uint32_t page_req;
+  const size_t begin = (size_t) (ptr - region->m_Base) / kPageSize;
+  const size_t end = begin + size / kPageSize;
+  size_t changed = 0;
+  size_t word;
 
-  DEBUG_THREAD_GUARD_ENTER(heap);
+  if (begin == end)
+    return 0;
 
-  // Figure out how many pages we're going to need.
-  // Always increment by one so we have room for a guard page at the end.
-  page_req = 1 + (uint32_t) ((size + kPageSize - 1) / kPageSize);
+  for (word = begin / 64; word <= (end - 1) / 64; ++word)
+  {
+    size_t lo = word * 64 < begin ? begin - word * 64 : 0;
+    size_t hi = (word + 1) * 64 > end ? end - word * 64 : 64;
+    uint64_t mask = (64 == hi - lo ? ~(uint64_t)0 : (((uint64_t)1 << (hi - lo)) - 1)) << lo;
+    uint64_t old_bits = region->m_Resident[word];
+
+    region->m_Resident[word] = resident ? old_bits | mask : old_bits & ~mask;
+    changed += PopCount64(old_bits ^ region->m_Resident[word]);
+  }
+
+  return changed;
+}
 
-  if (NULL != (ptr = AllocFromFreeList(heap, page_req)))
+static size_t SimulatedBitsBytes(size_t size)
+{
+  return RoundUpToPage((size / kPageSize + 63) / 64 * sizeof(uint64_t));
+}
+
+// The whole range is made accessible right away, so nothing after this
+// reaches the system until the range is freed.
+static void* SimulatedAllocate(void* context, size_t size)
+{
+  DebugHeapSimulatedVm* vm = (DebugHeapSimulatedVm*) context;
+  const size_t bits_bytes = SimulatedBitsBytes(size);
+  DebugSimulatedRegion* region = NULL;
+  uint32_t i;
+  char* base;
+
+  for (i = 0; i < kMaxSegments && !region; ++i)
   {
-    void* result = FinalizeAlloc(ptr, size, page_req, alignment);
-    DEBUG_THREAD_GUARD_LEAVE(heap);
-    return result;
+    if (!vm->m_Regions[i].m_Base)
+      region = &vm->m_Regions[i];
+  }
+
+  if (!region || NULL == (base = (char*) VmAllocate(size + bits_bytes)))
+    return NULL;
+
+  VmCommit(base, size + bits_bytes);
+
+  region->m_Base = base;
+  region->m_Size = size;
+  region->m_Resident = (uint64_t*) (base + size);
+  vm->m_ReservedBytes += size;
+
+  return base;
+}
+
+static void SimulatedFree(void* context, void* ptr, size_t size)
+{
+  DebugHeapSimulatedVm* vm = (DebugHeapSimulatedVm*) context;
+  DebugSimulatedRegion* region = SimulatedFindRegion(vm, (char*) ptr);
+
+  ASSERT_FATAL((region->m_Base == ptr && region->m_Size == size), "bad simulated free");
+
+  vm->m_CommittedBytes -= SimulatedSetResident(region, region->m_Base, size, 0) * kPageSize;
+  vm->m_ReservedBytes -= size;
+  VmFree(region->m_Base, size + SimulatedBitsBytes(size));
+  region->m_Base = NULL;
+}
+
+static void SimulatedCommit(void* context, void* ptr, size_t size)
+{
+  DebugHeapSimulatedVm* vm = (DebugHeapSimulatedVm*) context;
+  DebugSimulatedRegion* region = SimulatedFindRegion(vm, (char*) ptr);
+
+  vm->m_CommitCalls++;
+  vm->m_CommittedBytes += SimulatedSetResident(region, (char*) ptr, size, 1) * kPageSize;
+  if (vm->m_CommittedBytes > vm->m_PeakCommittedBytes)
+    vm->m_PeakCommittedBytes = vm->m_CommittedBytes;
+}
+
+static void SimulatedDecommit(void* context, void* ptr, size_t size)
+{
+  DebugHeapSimulatedVm* vm = (DebugHeapSimulatedVm*) context;
+  DebugSimulatedRegion* region = SimulatedFindRegion(vm, (char*) ptr);
+
+  vm->m_DecommitCalls++;
+  vm->m_CommittedBytes -= SimulatedSetResident(region, (char*) ptr, size, 0) * kPageSize;
+}
+
+DebugHeapSimulatedVm* DebugHeapSimulatedVmCreate(void)
+{
+  DebugHeapSimulatedVm* vm = (DebugHeapSimulatedVm*) VmAllocate(RoundUpToPage(sizeof(DebugHeapSimulatedVm)));
+
+  if (!vm)
+    return NULL;
+
+  VmCommit(vm, RoundUpToPage(sizeof(DebugHeapSimulatedVm)));
+
+  vm->m_Backend.m_Context  = vm;
+  vm->m_Backend.m_Allocate = SimulatedAllocate;
+  vm->m_Backend.m_Free     = SimulatedFree;
+  vm->m_Backend.m_Commit   = SimulatedCommit;
+  vm->m_Backend.m_Decommit = SimulatedDecommit;
+
+  return vm;
+}
+
+void DebugHeapSimulatedVmDestroy(DebugHeapSimulatedVm* vm)
+{
+  ASSERT_FATAL(0 == vm->m_ReservedBytes, "simulated memory still in use");
+  VmFree(vm, RoundUpToPage(sizeof(DebugHeapSimulatedVm)));
+}
+
+const DebugHeapVmBackend* DebugHeapSimulatedVmBackend(DebugHeapSimulatedVm* vm)
+{
+  return &vm->m_Backend;
+}
+
+void DebugHeapSimulatedVmGetStats(const DebugHeapSimulatedVm* vm, DebugHeapSimulatedVmStats* stats)
+{
+  stats->m_ReservedBytes      = vm->m_ReservedBytes;
+  stats->m_CommittedBytes     = vm->m_CommittedBytes;
+  stats->m_PeakCommittedBytes = vm->m_PeakCommittedBytes;
+  stats->m_CommitCalls        = vm->m_CommitCalls;
+  stats->m_DecommitCalls      = vm->m_DecommitCalls;
+}
+
+//-----------------------------------------------------------------------------
+// Sampling front end
+
+// Routing rules. Callsites live in an open-addressed hash set that is never
+// resized, and removed entries leave a tombstone, so lookups can probe it
+// without the lock. Inserts reuse the first tombstone on their probe path.
+enum
+{
+  kRouteCallsiteBits   = 8,
+  kRouteCallsiteSlots  = 1 << kRouteCallsiteBits,
+  kRouteCallsiteMax    = kRouteCallsiteSlots * 3 / 4,
+  kRouteSizeRangeMax   = 8,
+};
+
+#define ROUTE_TOMBSTONE ((uintptr_t) 1)
+
+struct DebugHeapSampler
+{
+  DebugHeapSamplerConfig m_Config;
+  DebugHeapMutex   m_Lock;
+
+  // Allocations, or bytes, left until the next sample. One is due when this
+  // drops to zero or below. Updated without the lock.
+  DebugHeapAtomicType m_Countdown;
+  uint32_t         m_Random;
+
+  // Address range covering every segment the heap has had. It only grows,
+  // so frees can check it without the lock.
+  volatile uintptr_t m_HullBegin;
+  volatile uintptr_t m_HullEnd;
+
+  // Allocations from these callsites, or with sizes in these ranges, always
+  // go to the heap. They are changed under the lock and read without it;
+  // a lookup racing with a change may route one allocation either way.
+  // The callsite set counts its live entries, and the slots that aren't
+  // empty, which includes tombstones.
+  volatile uint32_t  m_CallsiteCount;
+  uint32_t           m_CallsiteUsed;
+  volatile uintptr_t m_Callsites[kRouteCallsiteSlots];
+  volatile uint32_t  m_SizeRangeCount;
+  DebugHeapSizeRange m_SizeRanges[kRouteSizeRangeMax];
+
+  uint32_t         m_SampledAllocs;
+  uint32_t         m_SampleFailures;
+  uint32_t         m_RoutedAllocs;
+  DebugHeapAtomicType m_BackingAllocs;
+};
+
+static uint32_t RouteCallsiteHome(uintptr_t callsite)
+{
+  return (uint32_t) (((uint64_t) callsite * 0x9e3779b97f4a7c15ull) >> (64 - kRouteCallsiteBits));
+}
+
+// Returns the callsite's slot, or ~0u if it isn't in the set.
+static uint32_t RouteCallsiteFind(const DebugHeapSampler* sampler, uintptr_t callsite)
+{
+  uint32_t i = RouteCallsiteHome(callsite);
+  uint32_t probes;
+
+  for (probes = 0; probes < kRouteCallsiteSlots; ++probes)
+  {
+    uintptr_t entry = sampler->m_Callsites[i];
+
+    if (entry == callsite)
+      return i;
+    if (0 == entry)
+      break;
+
+    i = (i + 1) & (kRouteCallsiteSlots - 1);
   }
 
-  // We couldn't find a block off the free list. Consolidate pending frees.
-  FlushPendingFrees(heap);
+  return ~0u;
+}
+
+// Drops every tombstone by inserting the live callsites again. Lookups that
+// race with this may miss a callsite, and route one allocation either way.
+static void RouteCallsiteRebuild(DebugHeapSampler* sampler)
+{
+  uintptr_t live[kRouteCallsiteMax];
+  uint32_t i, count = 0;
 
-  // Try again.
-  if (NULL != (ptr = AllocFromFreeList(heap, page_req)))
+  for (i = 0; i < kRouteCallsiteSlots; ++i)
   {
-    void* result = FinalizeAlloc(ptr, size, page_req, alignment);
-    DEBUG_THREAD_GUARD_LEAVE(heap);
-    return result;
+    if (ROUTE_TOMBSTONE < sampler->m_Callsites[i])
+      live[count++] = sampler->m_Callsites[i];
+    sampler->m_Callsites[i] = 0;
   }
 
-  // Out of memory.
-  DEBUG_THREAD_GUARD_LEAVE(heap);
-  return NULL;
+  for (i = 0; i < count; ++i)
+  {
+    uint32_t slot = RouteCallsiteHome(live[i]);
+
+    while (0 != sampler->m_Callsites[slot])
+      slot = (slot + 1) & (kRouteCallsiteSlots - 1);
+
+    sampler->m_Callsites[slot] = live[i];
+  }
+
+  sampler->m_CallsiteUsed = count;
 }
 
-void DebugHeapFree(DebugHeap* heap, void* ptr_in)
+static int RouteMatch(const DebugHeapSampler* sampler, size_t size, const void* callsite)
 {
-  uintptr_t       ptr;
-  uintptr_t       relative_offset;
-  uint32_t        page_index;
-  DebugBlockInfo *block;
-  char           *block_base;
+  uint32_t i, count;
 
-  DEBUG_THREAD_GUARD_ENTER(heap);
+  if (callsite && sampler->m_CallsiteCount && ~0u != RouteCallsiteFind(sampler, (uintptr_t) callsite))
+    return 1;
 
-  // Figure out what page this belongs to.
-  ptr = (uintptr_t) ptr_in;
+  for (i = 0, count = sampler->m_SizeRangeCount; i < count; ++i)
+  {
+    if (size >= sampler->m_SizeRanges[i].m_Min && size <= sampler->m_SizeRanges[i].m_Max)
+      return 1;
+  }
+
+  return 0;
+}
 
-  relative_offset = ptr - (uintptr_t) heap->m_BaseAddress;
-  page_index = (uint32_t) (relative_offset / kPageSize);
+// Pick the distance to the next sample at random, averaging the interval,
+// so allocation patterns can't line up with the sampling.
+static uint32_t SamplerNextCountdown(DebugHeapSampler* sampler)
+{
+  size_t interval = sampler->m_Config.m_Interval;
+  uint32_t x = sampler->m_Random;
 
-  ASSERT_FATAL(page_index < heap->m_PageCount, "Invalid pointer %p freed", ptr_in);
+  if (0 == interval)
+    return 0x40000000;
+  if (1 == interval)
+    return 1;
+  if (interval > 0x40000000)
+    interval = 0x40000000;
 
-  block = heap->m_BlockLookup[page_index];
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  sampler->m_Random = x;
 
-  ASSERT_FATAL(block, "Double free of %p", ptr_in);
+  return 1 + (uint32_t) (x % (2 * interval - 1));
+}
 
-  ASSERT_FATAL((uint32_t)block->m_Allocated, "Block state corrupted");
-  ASSERT_FATAL(!block->m_PendingFree, "Block state corrupted");
+// Grow the hull to cover all of the heap's segments. The heap is locked.
+static void SamplerUpdateHull(DebugHeapSampler* sampler)
+{
+  const DebugHeap* heap = sampler->m_Config.m_Heap;
+  uint32_t slot;
 
-  // TODO: Check the fill pattern before the user pointer.
+  for (slot = 0; slot < heap->m_MaxSegments; ++slot)
+  {
+    const DebugSegment* segment = &heap->m_Segments[slot];
+    uintptr_t begin = (uintptr_t) segment->m_Base;
+    uintptr_t end = begin + (uint64_t) segment->m_PageCount * kPageSize;
 
-  block->m_Allocated = 0;
-  block->m_PendingFree = 1;
+    if (!segment->m_Base)
+      continue;
+    if (begin < sampler->m_HullBegin)
+      sampler->m_HullBegin = begin;
+    if (end > sampler->m_HullEnd)
+      sampler->m_HullEnd = end;
+  }
+}
 
-  // Zero out this block in the lookup to catch double frees.
-  heap->m_BlockLookup[page_index] = NULL;
+DebugHeapSampler* DebugHeapSamplerCreate(const DebugHeapSamplerConfig* config)
+{
+  DebugHeapSampler* sampler = (DebugHeapSampler*) VmAllocate(RoundUpToPage(sizeof(DebugHeapSampler)));
+
+  if (!sampler)
+    return NULL;
+
+  VmCommit(sampler, RoundUpToPage(sizeof(DebugHeapSampler)));
 
+  sampler->m_Config = *config;
+  MutexInit(&sampler->m_Lock);
+  sampler->m_Random = (uint32_t) (uintptr_t) sampler ^ TimeNowMs();
+  if (0 == sampler->m_Random)
+    sampler->m_Random = 1;
+  sampler->m_Countdown = SamplerNextCountdown(sampler);
+  sampler->m_HullBegin = ~(uintptr_t)0;
+  sampler->m_HullEnd = 0;
+  sampler->m_CallsiteCount = 0;
+  sampler->m_CallsiteUsed = 0;
+  memset((void*) sampler->m_Callsites, 0, sizeof sampler->m_Callsites);
+  sampler->m_SizeRangeCount = 0;
+  sampler->m_SampledAllocs = 0;
+  sampler->m_SampleFailures = 0;
+  sampler->m_RoutedAllocs = 0;
+  sampler->m_BackingAllocs = 0;
+  SamplerUpdateHull(sampler);
+
+  return sampler;
+}
+
+void DebugHeapSamplerDestroy(DebugHeapSampler* sampler)
+{
+  MutexDestroy(&sampler->m_Lock);
+  VmFree(sampler, RoundUpToPage(sizeof(DebugHeapSampler)));
+}
+
+void* DebugHeapSamplerAllocate(DebugHeapSampler* sampler, size_t size, size_t alignment)
+{
+  return DebugHeapSamplerAllocateFrom(sampler, size, alignment, NULL);
+}
+
+void* DebugHeapSamplerAllocateFrom(DebugHeapSampler* sampler, size_t size, size_t alignment, const void* callsite)
+{
+  const DebugHeapSamplerConfig* config = &sampler->m_Config;
+  int32_t step = 1;
+  int routed, due;
+  void* ptr = NULL;
+
+  if (kDebugHeapSampleBytes == config->m_Mode)
+    step = size < 0x40000000 ? (int32_t) size : 0x40000000;
+
+  routed = RouteMatch(sampler, size, callsite);
+  due = (int32_t) AtomicAdd32(&sampler->m_Countdown, -step) <= 0;
+
+  // Routed allocations ignore the sample size limit.
+  if (size > 0 && (routed || (due && (0 == config->m_MaxSampleSize || size <= config->m_MaxSampleSize))))
   {
-    uint32_t i, max;
-    for (i = 1, max = block->m_PageCount; i < max; ++i)
+    MutexLock(&sampler->m_Lock);
+
+    if (due)
+      AtomicStore32(&sampler->m_Countdown, SamplerNextCountdown(sampler));
+
+    if (routed || config->m_Interval)
     {
-      ASSERT_FATAL(heap->m_BlockLookup[page_index + i] == NULL, "block lookup corrupted");
+      ptr = DebugHeapAllocate(config->m_Heap, size, alignment);
+
+      if (ptr)
+      {
+        if (routed)
+          sampler->m_RoutedAllocs++;
+        else
+          sampler->m_SampledAllocs++;
+        SamplerUpdateHull(sampler);
+      }
+      else
+      {
+        sampler->m_SampleFailures++;
+      }
     }
+
+    MutexUnlock(&sampler->m_Lock);
+
+    if (ptr)
+      return ptr;
   }
 
-  // Add the block to the pending free list
-  heap->m_PendingList[heap->m_PendingListSize++] = block;
+  AtomicInc32(&sampler->m_BackingAllocs);
+  return config->m_Backing.m_Allocate(config->m_Backing.m_Context, size, alignment);
+}
+
+int DebugHeapSamplerAddCallsite(DebugHeapSampler* sampler, const void* callsite)
+{
+  uintptr_t key = (uintptr_t) callsite;
+  int added = 1;
+
+  ASSERT_FATAL((key > ROUTE_TOMBSTONE), "Invalid callsite %p", callsite);
 
-  // Protect these blocks from reading or writing completely by decommiting the pages.
-  // The last page is already inaccessible.
-  block_base = heap->m_BaseAddress + ((uint64_t)block->m_PageIndex) * kPageSize;
-  VmDecommit(block_base, ((uint64_t)(block->m_PageCount - 1)) * kPageSize);
+  MutexLock(&sampler->m_Lock);
 
-  DEBUG_THREAD_GUARD_LEAVE(heap);
+  if (~0u == RouteCallsiteFind(sampler, key))
+  {
+    // The callsite isn't anywhere on its probe path, so it can go in the
+    // first tombstone or empty slot there. A lookup racing with the store
+    // sees either the old entry or the callsite, and both keep it probing
+    // correctly. Filling an empty slot when tombstones already take up the
+    // rest of the budget rebuilds the set instead, so failed lookups keep
+    // finding an empty slot soon.
+    if (sampler->m_CallsiteCount < kRouteCallsiteMax)
+    {
+      uint32_t i = RouteCallsiteHome(key);
+
+      while (ROUTE_TOMBSTONE < sampler->m_Callsites[i])
+        i = (i + 1) & (kRouteCallsiteSlots - 1);
+
+      if (0 == sampler->m_Callsites[i])
+      {
+        if (sampler->m_CallsiteUsed >= kRouteCallsiteMax)
+        {
+          RouteCallsiteRebuild(sampler);
+
+          i = RouteCallsiteHome(key);
+          while (0 != sampler->m_Callsites[i])
+            i = (i + 1) & (kRouteCallsiteSlots - 1);
+        }
+
+        sampler->m_CallsiteUsed++;
+      }
+
+      sampler->m_Callsites[i] = key;
+      sampler->m_CallsiteCount++;
+    }
+    else
+    {
+      added = 0;
+    }
+  }
+
+  MutexUnlock(&sampler->m_Lock);
+  return added;
 }
 
-size_t DebugHeapGetAllocSize(DebugHeap* heap, void* ptr_in)
+void DebugHeapSamplerRemoveCallsite(DebugHeapSampler* sampler, const void* callsite)
 {
-  uintptr_t ptr;
-  uintptr_t relative_offset;
-  uint32_t page_index;
-  size_t result;
-  DebugBlockInfo* block;
+  uint32_t i;
 
-  DEBUG_THREAD_GUARD_ENTER(heap);
+  MutexLock(&sampler->m_Lock);
 
-  // Figure out what page this belongs to.
-  ptr = (uintptr_t) ptr_in;
+  if (~0u != (i = RouteCallsiteFind(sampler, (uintptr_t) callsite)))
+  {
+    sampler->m_Callsites[i] = ROUTE_TOMBSTONE;
+    sampler->m_CallsiteCount--;
 
-  relative_offset = ptr - (uintptr_t) heap->m_BaseAddress;
-  page_index = (uint32_t) (relative_offset / kPageSize);
+    // Tombstones at the end of a probe chain guard nothing, so they can go
+    // back to empty and keep failed lookups short.
+    while (0 == sampler->m_Callsites[(i + 1) & (kRouteCallsiteSlots - 1)] &&
+           ROUTE_TOMBSTONE == sampler->m_Callsites[i])
+    {
+      sampler->m_Callsites[i] = 0;
+      sampler->m_CallsiteUsed--;
+      i = (i - 1) & (kRouteCallsiteSlots - 1);
+    }
+  }
 
-  ASSERT_FATAL(page_index < heap->m_PageCount, "Invalid pointer %p", ptr_in);
+  MutexUnlock(&sampler->m_Lock);
+}
 
-  block = heap->m_BlockLookup[page_index];
+void DebugHeapSamplerClearCallsites(DebugHeapSampler* sampler)
+{
+  uint32_t i;
 
-  result = (block->m_PageCount - 1) * kPageSize - ptr % kPageSize;
+  MutexLock(&sampler->m_Lock);
 
-  DEBUG_THREAD_GUARD_LEAVE(heap);
+  sampler->m_CallsiteCount = 0;
+  for (i = 0; i < kRouteCallsiteSlots; ++i)
+    sampler->m_Callsites[i] = 0;
+  sampler->m_CallsiteUsed = 0;
 
-  return result;
+  MutexUnlock(&sampler->m_Lock);
 }
 
-int DebugHeapOwns(DebugHeap* heap, void* buffer)
+int DebugHeapSamplerSetSizeRanges(DebugHeapSampler* sampler, const DebugHeapSizeRange* ranges, unsigned int count)
 {
-  uintptr_t ptr;
-  uintptr_t base;
-  uintptr_t end;
-  int status;
+  unsigned int i;
 
-  DEBUG_THREAD_GUARD_ENTER(heap);
+  if (count > kRouteSizeRangeMax)
+    return 0;
 
-  ptr = (uintptr_t) buffer;
-  base = (uintptr_t) heap->m_BaseAddress;
-  end = base + ((uint64_t)heap->m_PageCount) * kPageSize;
-  status = ptr >= base && ptr <= end;
+  MutexLock(&sampler->m_Lock);
 
-  DEBUG_THREAD_GUARD_LEAVE(heap);
-  return status;
+  // Shrink the count first, so lookups never see a range half written.
+  sampler->m_SizeRangeCount = 0;
+  for (i = 0; i < count; ++i)
+    sampler->m_SizeRanges[i] = ranges[i];
+  sampler->m_SizeRangeCount = count;
+
+  MutexUnlock(&sampler->m_Lock);
+  return 1;
+}
+
+void DebugHeapSamplerFree(DebugHeapSampler* sampler, void* ptr)
+{
+  const DebugHeapSamplerConfig* config = &sampler->m_Config;
+  const uintptr_t addr = (uintptr_t) ptr;
+
+  if (!ptr)
+    return;
+
+  // Most pointers are nowhere near the heap, and go straight to the backing
+  // allocator. The backing allocator's memory can still fall between
+  // segments, so pointers inside the hull need the exact check.
+  if (addr >= sampler->m_HullBegin && addr < sampler->m_HullEnd)
+  {
+    int owned;
+
+    MutexLock(&sampler->m_Lock);
+    owned = DebugHeapOwns(config->m_Heap, ptr);
+    if (owned)
+      DebugHeapFree(config->m_Heap, ptr);
+    MutexUnlock(&sampler->m_Lock);
+
+    if (owned)
+      return;
+  }
+
+  config->m_Backing.m_Free(config->m_Backing.m_Context, ptr);
+}
+
+void DebugHeapSamplerGetStats(DebugHeapSampler* sampler, DebugHeapSamplerStats* stats)
+{
+  MutexLock(&sampler->m_Lock);
+  stats->m_SampledAllocs  = sampler->m_SampledAllocs;
+  stats->m_SampleFailures = sampler->m_SampleFailures;
+  stats->m_RoutedAllocs   = sampler->m_RoutedAllocs;
+  stats->m_BackingAllocs  = AtomicLoad32(&sampler->m_BackingAllocs);
+  MutexUnlock(&sampler->m_Lock);
 }
@@ -40,6 +40,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
 // - Array indexing errors (positive) trigger crashes, because allocations are
 //   aligned as closely as possible up to an inaccessible virtual memory page.
+// 
+// - Array indexing errors (negative) that stay within the page are detected
+//   when the allocation is freed, by checking the fill pattern in front of it.
 //
 // - Using memory after freeing it trigger crashes most of the time.
 //
@@ -50,7 +53,24 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // To improve the chances of crashing on use-after-free or double frees,
 // increase the size of the heap. Freed blocks are kept on an "observation
 // list" for as long as possible to flush out these error classes, but it will
-// eventually be reused.
+// eventually be reused. The list is first-in, first-out, and can be capped by
+// size, block count or age (see DebugHeapConfig) to keep memory use steady.
+// Rather than sizing the heap for the worst case up front, you can also let it
+// grow by reserving extra segments as needed.
+//
+// On Linux 6.13 and later, inaccessible pages can be made with lightweight guard
+// regions instead (see DebugHeapConfig::m_GuardMode), which lifts the limit on
+// live allocations imposed by vm.max_map_count.
+//
+// The heap's pages can also come from a custom virtual memory backend. A
+// simulated one that makes no system calls is included, for benchmarking
+// and for running long stress tests quickly.
+//
+// To keep memory error detection on in normal runs, a sampling front end can
+// send just one allocation in every so many to the debug heap, and the rest
+// to your regular allocator.
+// It can also route allocations from given callsites, or in given size
+// ranges, to the debug heap when you already suspect some code.
 //
 // This heap is terribly slow, and wastes tons of memory. You only want to use
 // it to track down memory errors. One neat way of doing that is to provide a
@@ -59,12 +79,245 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 typedef struct DebugHeap DebugHeap;
 
+// Placement engines, selected with DebugHeapConfig::m_Engine.
+typedef enum DebugHeapEngine
+{
+  // Address-ordered block list with size-binned free lists. Best fit.
+  kDebugHeapEngineList   = 0,
+  // Multi-level page bitmap. First fit, with coalescing for free. Bookkeeping
+  // cost doesn't grow with fragmentation, which helps very large heaps.
+  kDebugHeapEngineBitmap = 1,
+} DebugHeapEngine;
+
+// How inaccessible pages (guard pages and freed blocks) are made, selected
+// with DebugHeapConfig::m_GuardMode.
+typedef enum DebugHeapGuardMode
+{
+  // Guard regions if the kernel supports them, page protection otherwise.
+  kDebugHeapGuardAuto    = 0,
+  // Page protection (mprotect/VirtualFree). Every live allocation splits
+  // the mapping, see m_MappingBudget.
+  kDebugHeapGuardPages   = 1,
+  // Linux 6.13+ guard regions (MADV_GUARD_INSTALL). These don't split the
+  // mapping, so there is no limit on live allocations, and they contend
+  // less on the kernel's mmap lock.
+  kDebugHeapGuardRegions = 2,
+} DebugHeapGuardMode;
+
+// Virtual memory operations for the heap's pages, see
+// DebugHeapConfig::m_VmBackend. Allocate reserves an inaccessible range and
+// returns NULL on failure. Commit makes pages accessible, and Decommit makes
+// them inaccessible and lets their contents go. Sizes are multiples of 4k.
+// Bookkeeping memory always comes from the platform.
+typedef struct DebugHeapVmBackend
+{
+  void*         m_Context;
+  void*         (*m_Allocate)(void* context, size_t size);
+  void          (*m_Free)(void* context, void* ptr, size_t size);
+  void          (*m_Commit)(void* context, void* ptr, size_t size);
+  void          (*m_Decommit)(void* context, void* ptr, size_t size);
+} DebugHeapVmBackend;
+
+// Tuning parameters for DebugHeapInitWithConfig().
+// Fill in the defaults with DebugHeapDefaultConfig() and override what you need.
+typedef struct DebugHeapConfig
+{
+  // Size of the heap in bytes. See DebugHeapInit().
+  size_t        m_Size;
+
+  // How free pages are tracked and allocations are placed.
+  DebugHeapEngine m_Engine;
+
+  // Freed blocks can be coalesced back into the free list a few at a time, so
+  // no single call pays for coalescing the whole observation list. This is
+  // the maximum number of freed blocks coalesced per allocation or free.
+  // Zero (the default) coalesces everything at once, and only when an
+  // allocation fails.
+  unsigned int  m_FlushBudget;
+
+  // With a flush budget set, incremental coalescing starts when fewer than
+  // this many bytes are free, so the work is spread out before the free list
+  // runs dry.
+  size_t        m_FlushLowWatermark;
+
+  // Limits for the observation list of freed blocks. When any limit is
+  // exceeded, the oldest freed blocks are released for reuse first. Zero
+  // means no limit; with no limits at all, freed blocks stay on the list
+  // until the heap runs low on free pages.
+  size_t        m_QuarantineBytes;
+  unsigned int  m_QuarantineBlocks;
+  unsigned int  m_QuarantineMilliseconds;
+
+  // The heap starts out as a single segment of m_Size bytes. When that is
+  // full it reserves additional segments of m_GrowSize bytes (or larger, up
+  // to the larger of the two sizes, for big allocations), up to a total of
+  // m_MaxSegments (at most 64). Grown segments are released back to the OS
+  // once all of their blocks have been freed and have left the observation
+  // list. The default of one segment means the heap never grows.
+  size_t        m_GrowSize;
+  unsigned int  m_MaxSegments;
+
+  // Linux limits the number of memory mappings a process can have
+  // (vm.max_map_count, usually 65530), and every live allocation costs about
+  // two of them, because its guard page splits the mapping. Allocations fail
+  // once the heap's estimated mapping count reaches this budget, rather than
+  // crashing in mprotect(). Zero picks a budget from the system limit at
+  // init, leaving room for the rest of the process. ~0u disables the check.
+  unsigned int  m_MappingBudget;
+
+  // How guard pages and freed blocks are made inaccessible. The default
+  // configuration uses page protection; guard regions are opt-in.
+  DebugHeapGuardMode m_GuardMode;
+
+  // Decommit freed blocks in batches of up to this many ranges (at most 64),
+  // merging neighbors, instead of one system call per free. On Linux with
+  // guard regions, a batch is a single process_madvise() call. Queued blocks
+  // stay accessible until their batch goes out, so use-after-free right
+  // after a free can go unnoticed. Zero decommits every free right away.
+  unsigned int  m_DecommitBatch;
+
+  // Where the heap's pages come from. NULL means the platform's virtual
+  // memory. The backend is copied, but its context must outlive the heap.
+  // Guard regions need the platform backend, and other backends get no
+  // automatic mapping budget.
+  const DebugHeapVmBackend* m_VmBackend;
+
+  // Non-zero takes the expensive part of freeing off the calling thread.
+  // Freed blocks are made inaccessible right away with a cheap protection
+  // change, and a worker thread releases their pages in the background,
+  // merging neighbors. Blocks aren't reused until the worker is done with
+  // them. This needs page protection, so guard regions aren't used, and the
+  // platform backend; otherwise frees decommit on the calling thread.
+  int           m_AsyncDecommit;
+
+  // Keep up to this many ready slots for allocations of up to 64k: placed,
+  // committed by a worker thread, with the guard page in place. Handing one
+  // out takes no searching and no system calls. The slots are shared out
+  // between sizes by recent demand, and given back if the heap runs out of
+  // room. Zero disables them. Like m_AsyncDecommit, this needs the platform
+  // backend.
+  unsigned int  m_ReadySlots;
+
+  // Up to this many bytes of freed blocks are filled with a poison pattern
+  // and left committed, instead of being decommitted. The poison is checked
+  // when a block leaves the observation list, which catches writes after
+  // free but not reads, and its pages are then reused without any system
+  // calls. Past the budget, freed blocks are decommitted as usual. Zero
+  // disables poisoning. See also DebugHeapSetPoisonBudget().
+  size_t        m_PoisonBudget;
+
+  // Right against the guard page, every allocation of a given size starts at
+  // the same page offset, so same-sized allocations compete for the same
+  // cache sets. Non-zero rotates allocation starts back through up to this
+  // many 64-byte cache lines (at most 64), as far as the page allows. The
+  // bytes left between the end of an allocation and its guard page hold a
+  // canary, checked on free, so small overruns are still caught to the
+  // byte, though not when they happen. Zero disables coloring.
+  unsigned int  m_CacheColors;
+
+  // Only fill up to this many bytes in front of each allocation with the
+  // 0xfc pattern, instead of everything from the start of its page. A small
+  // window makes small allocations much cheaper, but writes further in
+  // front of an allocation than the window goes unnoticed. Zero fills it
+  // all. The pattern is checked on free, which catches underruns.
+  size_t        m_FillWindow;
+
+  // Non-zero fills the alignment slack between the end of each allocation
+  // and its guard page with a canary, checked on free, so overruns smaller
+  // than the alignment are caught too. Cache coloring and paired blocks
+  // always do this.
+  int           m_TailCanary;
+
+  // Non-zero lets two small allocations share one page between two guard
+  // pages, one at the start of the page and one at the end, for 1.5 pages
+  // per allocation instead of 2. Underflows of the first and overflows of
+  // the second crash right away. The rest of each half holds a canary or
+  // poison, checked when the page changes hands and on free, so overruns
+  // between the two are caught later. A freed half stays accessible, and
+  // poisoned, until its neighbor is freed. Applies to allocations where the
+  // size plus alignment is at most 2k; these aren't colored.
+  int           m_PairedLayout;
+
+  // Allocations of up to this many bytes (at most 64), with alignment of up
+  // to 16, are packed into shared pages by size class instead of getting a
+  // page and guard page each. Slots are separated by canaries, and freed
+  // slots are poisoned and reused round-robin. Canaries are checked on free
+  // and poison on reuse, so overruns and writes after free are caught late
+  // rather than when they happen, and reads after free aren't caught until
+  // the whole page is freed. Zero disables packing.
+  size_t        m_PackedMaxSize;
+} DebugHeapConfig;
+
+// Statistics for a heap, see DebugHeapGetStats().
+typedef struct DebugHeapStats
+{
+  // Bytes of free pages available for allocation, and bytes held on the
+  // observation list.
+  size_t        m_FreeBytes;
+  size_t        m_PendingBytes;
+  unsigned int  m_PendingBlocks;
+
+  // Number of segments currently reserved.
+  unsigned int  m_SegmentCount;
+
+  // Non-zero if the heap uses guard regions rather than page protection.
+  int           m_GuardRegions;
+
+  // Estimated memory mappings used by the heap, the budget for them (zero if
+  // unlimited), and the number of allocations refused for lack of budget.
+  unsigned int  m_MappingCount;
+  unsigned int  m_MappingBudget;
+  unsigned int  m_MappingFailures;
+
+  // Page protection changes asked for, and the system calls they took.
+  // Changes to pages already in the right state are skipped.
+  unsigned int  m_ProtectRequests;
+  unsigned int  m_ProtectCalls;
+
+  // Worker thread: ranges it hasn't finished, the system calls it has
+  // made, and the times the heap had to wait for it.
+  unsigned int  m_AsyncPending;
+  unsigned int  m_AsyncCalls;
+  unsigned int  m_AsyncWaits;
+
+  // Bytes of committed pages outside allocations, which are mostly poisoned
+  // freed blocks, the budget for them, and the number of frees poisoned.
+  size_t        m_PoisonedBytes;
+  size_t        m_PoisonBudget;
+  unsigned int  m_PoisonedFrees;
+
+  // Packed pages in use, and the allocations in them.
+  unsigned int  m_PackedPageCount;
+  unsigned int  m_PackedSlotCount;
+
+  // Ready slots: allocations served from them and not, and slots held now.
+  unsigned int  m_ReadyHits;
+  unsigned int  m_ReadyMisses;
+  unsigned int  m_ReadySlotCount;
+
+  // Block infos track allocated, pending and free page ranges. These are the
+  // number in use, the most ever in use at once, and the memory committed for
+  // them, which follows the high-water mark.
+  unsigned int  m_BlockInfoCount;
+  unsigned int  m_BlockInfoHighWater;
+  size_t        m_BlockInfoCommittedBytes;
+} DebugHeapStats;
+
+// Fill in a default configuration for a heap of the given size.
+void DebugHeapDefaultConfig(DebugHeapConfig* config, size_t size);
+
 // Create and initialize a debug heap.
 // The size must be a multiple of the page size (4k), and should be generously padded.
 // At the very least you need 2 pages per sub-4k allocation, but the more the better.
 // The implementation is 64-bit clean and you can throw more than 4 GB at it just fine.
+// This uses the default configuration. On Linux, that reads
+// /proc/sys/vm/max_map_count and /proc/self/maps at init to pick a mapping
+// budget (see DebugHeapConfig::m_MappingBudget).
 DebugHeap* DebugHeapInit(size_t size);
 
+// Create and initialize a debug heap with explicit tuning parameters.
+DebugHeap* DebugHeapInitWithConfig(const DebugHeapConfig* config);
+
 // Nuke a debug heap. All memory is returned to the OS.
 void DebugHeapDestroy(DebugHeap* heap);
 
@@ -80,10 +333,144 @@ void DebugHeapFree(DebugHeap* heap, void* ptr);
 // Return the allocation size for a previously allocated block.
 size_t DebugHeapGetAllocSize(DebugHeap* heap, void* ptr);
 
-// A quick and dirty range check to see if a buffer could have come from a debug heap.
+// Change the poison budget (see DebugHeapConfig::m_PoisonBudget). Lowering it
+// takes effect as poisoned blocks leave the observation list.
+void DebugHeapSetPoisonBudget(DebugHeap* heap, size_t bytes);
+
+// Report statistics for a debug heap.
+void DebugHeapGetStats(DebugHeap* heap, DebugHeapStats* stats);
+
+// The platform's virtual memory, for backends that wrap it.
+const DebugHeapVmBackend* DebugHeapPlatformVmBackend(void);
+
+// A backend that simulates virtual memory, for benchmarking placement and
+// quarantine, and running long stress tests or trace replays quickly. Each
+// range is reserved and made accessible once, and commits and decommits
+// after that only track residency, so no system calls are made. Memory
+// errors are not caught. Use one per heap.
+typedef struct DebugHeapSimulatedVm DebugHeapSimulatedVm;
+
+typedef struct DebugHeapSimulatedVmStats
+{
+  // Bytes reserved, and bytes that would be committed now and at the peak.
+  size_t        m_ReservedBytes;
+  size_t        m_CommittedBytes;
+  size_t        m_PeakCommittedBytes;
+
+  // Commit and decommit calls made by the heap.
+  unsigned int  m_CommitCalls;
+  unsigned int  m_DecommitCalls;
+} DebugHeapSimulatedVmStats;
+
+DebugHeapSimulatedVm* DebugHeapSimulatedVmCreate(void);
+
+// Destroy the heap using the backend first.
+void DebugHeapSimulatedVmDestroy(DebugHeapSimulatedVm* vm);
+
+const DebugHeapVmBackend* DebugHeapSimulatedVmBackend(DebugHeapSimulatedVm* vm);
+
+void DebugHeapSimulatedVmGetStats(const DebugHeapSimulatedVm* vm, DebugHeapSimulatedVmStats* stats);
+
+// A quick range check to see if a buffer could have come from a debug heap.
 // Doesn't validate that the buffer is actually allocated.
 int DebugHeapOwns(DebugHeap* heap, void* buffer);
 
+// Sampling front end. Only one allocation in every so many goes to the debug
+// heap, and the rest to a regular allocator, so overflows and use after free
+// can be caught in normal runs at a small cost. Allocations and frees may
+// come from any thread; the heap is only touched under a lock.
+
+// The allocator that takes the allocations that aren't sampled.
+typedef struct DebugHeapBackingAllocator
+{
+  void*         m_Context;
+  void*         (*m_Allocate)(void* context, size_t size, size_t alignment);
+  void          (*m_Free)(void* context, void* ptr);
+} DebugHeapBackingAllocator;
+
+typedef enum DebugHeapSampleMode
+{
+  // Sample about one allocation in every m_Interval.
+  kDebugHeapSampleCount = 0,
+  // Sample about one allocation per m_Interval bytes allocated, so large
+  // allocations are more likely to be sampled.
+  kDebugHeapSampleBytes = 1,
+} DebugHeapSampleMode;
+
+typedef struct DebugHeapSamplerConfig
+{
+  // The heap for sampled allocations. Once the sampler is created, only use
+  // it through the sampler. The sampler doesn't destroy it.
+  DebugHeap*    m_Heap;
+  DebugHeapBackingAllocator m_Backing;
+  DebugHeapSampleMode m_Mode;
+  // The average distance between samples is picked at random around this.
+  // One samples everything. Zero samples nothing, so only routed allocations
+  // go to the heap (see DebugHeapSamplerAddCallsite()).
+  size_t        m_Interval;
+  // Larger allocations are never sampled. Zero means no limit.
+  size_t        m_MaxSampleSize;
+} DebugHeapSamplerConfig;
+
+typedef struct DebugHeapSamplerStats
+{
+  // Allocations served by the debug heap, samples that didn't fit in it and
+  // went to the backing allocator instead, and backing allocations in all.
+  unsigned int  m_SampledAllocs;
+  unsigned int  m_SampleFailures;
+  unsigned int  m_BackingAllocs;
+
+  // Allocations that went to the debug heap because of a routing rule.
+  unsigned int  m_RoutedAllocs;
+} DebugHeapSamplerStats;
+
+// An inclusive range of allocation sizes.
+typedef struct DebugHeapSizeRange
+{
+  size_t        m_Min;
+  size_t        m_Max;
+} DebugHeapSizeRange;
+
+typedef struct DebugHeapSampler DebugHeapSampler;
+
+DebugHeapSampler* DebugHeapSamplerCreate(const DebugHeapSamplerConfig* config);
+
+void DebugHeapSamplerDestroy(DebugHeapSampler* sampler);
+
+void* DebugHeapSamplerAllocate(DebugHeapSampler* sampler, size_t size, size_t alignment);
+
+// The return address of the current function, for use as a callsite in an
+// allocation wrapper.
+#if defined(_MSC_VER)
+void* _ReturnAddress(void);
+#pragma intrinsic(_ReturnAddress)
+#define DEBUG_HEAP_CALLSITE _ReturnAddress()
+#else
+#define DEBUG_HEAP_CALLSITE __builtin_return_address(0)
+#endif
+
+// Allocate, routing to the debug heap if the callsite or size matches one of
+// the routing rules, and sampling otherwise. Checking the rules costs a load
+// or two when there are none, and a hash probe per callsite lookup.
+void* DebugHeapSamplerAllocateFrom(DebugHeapSampler* sampler, size_t size, size_t alignment, const void* callsite);
+
+// Route every allocation from a callsite to the debug heap. Returns zero if
+// the set is full; it holds 192 callsites. Rules can be changed at any time,
+// from any thread.
+int DebugHeapSamplerAddCallsite(DebugHeapSampler* sampler, const void* callsite);
+void DebugHeapSamplerRemoveCallsite(DebugHeapSampler* sampler, const void* callsite);
+void DebugHeapSamplerClearCallsites(DebugHeapSampler* sampler);
+
+// Route allocations with sizes in any of these ranges to the debug heap,
+// replacing the previous ranges. Returns zero if there are more than 8.
+int DebugHeapSamplerSetSizeRanges(DebugHeapSampler* sampler, const DebugHeapSizeRange* ranges, unsigned int count);
+
+// Free memory from either allocator. Pointers outside the address range of
+// the heap's segments go straight to the backing allocator without locking.
+void DebugHeapSamplerFree(DebugHeapSampler* sampler, void* ptr);
+
+void DebugHeapSamplerGetStats(DebugHeapSampler* sampler, DebugHeapSamplerStats* stats);
+
 #if defined(__cplusplus)
 }
 #endif
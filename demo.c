@@ -28,12 +28,41 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "DebugHeap.h"
 
+// Cases that check behavior rather than crash report each check here, and
+// exit with a non-zero status if any failed.
+static int s_Failures;
+
+static void Expect(int condition, const char* what)
+{
+  printf("%s: %s\n", condition ? "ok" : "FAILED", what);
+  fflush(stdout);
+  if (!condition)
+    ++s_Failures;
+}
+
+// Backing allocator for the sampler cases.
+static void* BackingAllocate(void* context, size_t size, size_t alignment)
+{
+  (void) context; (void) alignment;
+  return malloc(size);
+}
+
+static void BackingFree(void* context, void* ptr)
+{
+  (void) context;
+  free(ptr);
+}
+
 int main(int argc, char* argv[])
 {
+  DebugHeapConfig config;
+  DebugHeapSimulatedVm *vm = NULL;
   DebugHeap *heap;
+  int test;
 
   if (argc < 2) {
     fprintf(stderr, "Usage: demo <testcase>\n");
@@ -42,12 +71,55 @@ int main(int argc, char* argv[])
     fprintf(stderr, "1: array overrun (should crash)\n");
     fprintf(stderr, "2: double free (should assert)\n");
     fprintf(stderr, "3: use after free (should crash)\n");
+    fprintf(stderr, "4: mapping budget (should fail allocations, not crash)\n");
+    fprintf(stderr, "5: use after batched decommit (should crash)\n");
+    fprintf(stderr, "6: poisoned block use after free (should abort on flush)\n");
+    fprintf(stderr, "7: overrun into tail canary (should abort on free)\n");
+    fprintf(stderr, "8: paired left half overrun (should abort on free)\n");
+    fprintf(stderr, "9: paired right half overrun (should abort on free)\n");
+    fprintf(stderr, "10: packed slot overrun (should abort on free)\n");
+    fprintf(stderr, "11: packed slot use after free (should abort on reuse)\n");
+    fprintf(stderr, "12: packed slot double free (should assert)\n");
+    fprintf(stderr, "13: underrun into leading fill (should abort on free)\n");
+    fprintf(stderr, "14: cache colors, then overrun into color slack (should abort on free)\n");
+    fprintf(stderr, "15: bitmap engine refills a freed heap\n");
+    fprintf(stderr, "16: segments grow and are released\n");
+    fprintf(stderr, "17: simulated virtual memory tracks commits\n");
+    fprintf(stderr, "18: use after asynchronous decommit (should crash)\n");
+    fprintf(stderr, "19: ready slots serve repeated allocations\n");
+    fprintf(stderr, "20: sampler sends some allocations to the heap\n");
+    fprintf(stderr, "21: sampler routes callsites and sizes to the heap\n");
+    fprintf(stderr, "22: fill window limits the leading fill\n");
     exit(1);
   }
 
-  heap = DebugHeapInit(2 * 1024 * 1024);
+  test = atoi(argv[1]);
+
+  // Some of the checks have to be switched on.
+  DebugHeapDefaultConfig(&config, 2 * 1024 * 1024);
+  config.m_MappingBudget    = 4 == test ? 100 : 0;
+  config.m_DecommitBatch    = 5 == test ? 4 : 0;
+  config.m_PoisonBudget     = 6 == test ? 1024 * 1024 : 0;
+  config.m_QuarantineBlocks = 6 == test ? 1 : 0;
+  config.m_TailCanary       = 7 == test;
+  config.m_PairedLayout     = 8 == test || 9 == test;
+  config.m_PackedMaxSize    = (test >= 10 && test <= 12) ? 64 : 0;
+  config.m_CacheColors      = 14 == test ? 4 : 0;
+  config.m_Engine           = 15 == test ? kDebugHeapEngineBitmap : kDebugHeapEngineList;
+  config.m_GrowSize         = 16 == test ? 1024 * 1024 : config.m_Size;
+  config.m_MaxSegments      = 16 == test ? 4 : 1;
+  config.m_AsyncDecommit    = 18 == test;
+  config.m_ReadySlots       = 19 == test ? 16 : 0;
+  config.m_FillWindow       = 22 == test ? 64 : 0;
+
+  if (17 == test) {
+    vm = DebugHeapSimulatedVmCreate();
+    config.m_VmBackend = DebugHeapSimulatedVmBackend(vm);
+  }
+
+  heap = DebugHeapInitWithConfig(&config);
 
-  switch (atoi(argv[1])) {
+  switch (test) {
     case 0:
       {
         char* ptr;
@@ -84,12 +156,324 @@ int main(int argc, char* argv[])
       }
       break;
 
+    case 4:
+      {
+        char* ptrs[512];
+        int pass, i, count;
+        // Freed blocks must give their mappings back, so the heap fills up
+        // to the same count again.
+        for (pass = 0; pass < 2; ++pass) {
+          for (count = 0; count < 512; ++count) {
+            if (NULL == (ptrs[count] = DebugHeapAllocate(heap, 128, 4)))
+              break;
+          }
+          printf("pass %d: %d allocations fit the mapping budget\n", pass, count);
+          for (i = 0; i < count; ++i)
+            DebugHeapFree(heap, ptrs[i]);
+        }
+      }
+      break;
+
+    case 5:
+      {
+        char* ptrs[8];
+        int i;
+        for (i = 0; i < 8; ++i)
+          ptrs[i] = DebugHeapAllocate(heap, 128, 4);
+        // Neighbors merge into one range, so free every other block. The
+        // fourth free sends the whole batch out.
+        for (i = 0; i < 8; i += 2)
+          DebugHeapFree(heap, ptrs[i]);
+        ptrs[0][0] = 'a'; // should crash here
+      }
+      break;
+
+    case 6:
+      {
+        char* ptr;
+        ptr = DebugHeapAllocate(heap, 128, 4);
+        DebugHeapFree(heap, ptr);
+        ptr[0] = 'a'; // poisoned, so no crash
+        // The next free pushes the first block off the observation list.
+        DebugHeapFree(heap, DebugHeapAllocate(heap, 128, 4)); // should abort here
+      }
+      break;
+
+    case 7:
+      {
+        char* ptr;
+        ptr = DebugHeapAllocate(heap, 126, 4);
+        ptr[126] = 'a'; // alignment slack, so no crash
+        DebugHeapFree(heap, ptr); // should abort here
+      }
+      break;
+
+    case 8:
+      {
+        char* left;
+        char* right;
+        left = DebugHeapAllocate(heap, 128, 4);
+        right = DebugHeapAllocate(heap, 128, 4);
+        left[128] = 'a'; // same page as right, so no crash
+        DebugHeapFree(heap, left); // should abort here
+        DebugHeapFree(heap, right);
+      }
+      break;
+
+    case 9:
+      {
+        char* left;
+        char* right;
+        left = DebugHeapAllocate(heap, 128, 4);
+        right = DebugHeapAllocate(heap, 126, 4);
+        right[126] = 'a'; // alignment slack, so no crash
+        DebugHeapFree(heap, right); // should abort here
+        DebugHeapFree(heap, left);
+      }
+      break;
+
+    case 10:
+      {
+        char* ptr;
+        ptr = DebugHeapAllocate(heap, 24, 4);
+        ptr[24] = 'a';
+        DebugHeapFree(heap, ptr); // should abort here
+      }
+      break;
+
+    case 11:
+      {
+        char* ptr;
+        int i;
+        ptr = DebugHeapAllocate(heap, 24, 4);
+        DebugHeapFree(heap, ptr);
+        ptr[0] = 'a';
+        // Slots are reused round-robin, so it takes a page's worth.
+        for (i = 0; i < 100; ++i)
+          DebugHeapAllocate(heap, 24, 4); // should abort here
+      }
+      break;
+
+    case 12:
+      {
+        char* ptr;
+        ptr = DebugHeapAllocate(heap, 24, 4);
+        DebugHeapFree(heap, ptr);
+        DebugHeapFree(heap, ptr); // should assert here
+      }
+      break;
+
+    case 13:
+      {
+        char* ptr;
+        ptr = DebugHeapAllocate(heap, 128, 4);
+        ptr[-1] = 'a';
+        DebugHeapFree(heap, ptr); // should abort here
+      }
+      break;
+
+    case 14:
+      {
+        char* ptrs[4];
+        int i, j, distinct = 1;
+        for (i = 0; i < 4; ++i)
+          ptrs[i] = DebugHeapAllocate(heap, 100, 4);
+        for (i = 0; i < 4; ++i) {
+          for (j = 0; j < i; ++j) {
+            if (((uintptr_t) ptrs[i] & 4095) / 64 == ((uintptr_t) ptrs[j] & 4095) / 64)
+              distinct = 0;
+          }
+        }
+        Expect(distinct, "same-sized allocations start on different cache lines");
+        // The last one was moved furthest from its guard page.
+        ptrs[3][100] = 'a'; // color slack, so no crash
+        DebugHeapFree(heap, ptrs[3]); // should abort here
+      }
+      break;
+
+    case 15:
+      {
+        char* ptrs[512];
+        int counts[2];
+        int pass, i;
+        // Mixed sizes leave runs of different lengths for the bitmap to
+        // find. Filling up again has to flush the observation list and find
+        // every freed page.
+        for (pass = 0; pass < 2; ++pass) {
+          for (counts[pass] = 0; counts[pass] < 512; ++counts[pass]) {
+            size_t size = counts[pass] % 3 ? 128 : 3 * 4096;
+            if (NULL == (ptrs[counts[pass]] = DebugHeapAllocate(heap, size, 4)))
+              break;
+          }
+          for (i = 0; i < counts[pass]; ++i)
+            DebugHeapFree(heap, ptrs[i]);
+        }
+        printf("%d allocations, then %d\n", counts[0], counts[1]);
+        Expect(counts[0] > 0 && counts[0] == counts[1], "the heap fills up to the same count again");
+      }
+      break;
+
+    case 16:
+      {
+        char* ptrs[400];
+        DebugHeapStats stats;
+        unsigned int grown;
+        int i;
+        // Two pages each, so 400 allocations need more than the first 2 MB.
+        for (i = 0; i < 400; ++i)
+          ptrs[i] = DebugHeapAllocate(heap, 128, 4);
+        DebugHeapGetStats(heap, &stats);
+        grown = stats.m_SegmentCount;
+        Expect(NULL != ptrs[399] && grown > 1, "the heap grows by adding segments");
+        for (i = 0; i < 400; ++i)
+          DebugHeapFree(heap, ptrs[i]);
+        // An allocation that doesn't fit makes the heap flush the
+        // observation list, which releases the emptied segments.
+        Expect(NULL == DebugHeapAllocate(heap, 16 * 1024 * 1024, 4), "an oversized allocation fails");
+        DebugHeapGetStats(heap, &stats);
+        printf("%u segments, then %u\n", grown, stats.m_SegmentCount);
+        Expect(stats.m_SegmentCount < grown, "grown segments are released once their blocks are freed");
+      }
+      break;
+
+    case 17:
+      {
+        char* ptrs[16];
+        DebugHeapSimulatedVmStats before, during, after;
+        int i;
+        DebugHeapSimulatedVmGetStats(vm, &before);
+        for (i = 0; i < 16; ++i)
+          ptrs[i] = DebugHeapAllocate(heap, 3 * 4096, 4);
+        DebugHeapSimulatedVmGetStats(vm, &during);
+        for (i = 0; i < 16; ++i)
+          DebugHeapFree(heap, ptrs[i]);
+        DebugHeapSimulatedVmGetStats(vm, &after);
+        printf("committed %lu, then %lu, then %lu bytes\n", (unsigned long) before.m_CommittedBytes,
+            (unsigned long) during.m_CommittedBytes, (unsigned long) after.m_CommittedBytes);
+        Expect(during.m_CommittedBytes >= before.m_CommittedBytes + 16 * 3 * 4096, "allocations are committed");
+        Expect(after.m_CommittedBytes < during.m_CommittedBytes, "freed blocks are decommitted");
+        Expect(after.m_DecommitCalls > before.m_DecommitCalls, "the heap calls the backend to decommit");
+      }
+      break;
+
+    case 18:
+      {
+        char* ptrs[64];
+        DebugHeapStats stats;
+        int i;
+        for (i = 0; i < 64; ++i)
+          ptrs[i] = DebugHeapAllocate(heap, 128, 4);
+        for (i = 0; i < 64; ++i)
+          DebugHeapFree(heap, ptrs[i]);
+        DebugHeapGetStats(heap, &stats);
+        Expect(stats.m_AsyncPending + stats.m_AsyncCalls > 0, "frees are handed to the worker thread");
+        // The worker may not have got to it yet, but the page was made
+        // inaccessible on free.
+        ptrs[63][0] = 'a'; // should crash here
+      }
+      break;
+
+    case 19:
+      {
+        DebugHeapStats stats;
+        int i;
+        // The first allocations of a size miss and start filling slots for
+        // it in the background; later ones are served from them.
+        for (i = 0; i < 1000; ++i)
+          DebugHeapFree(heap, DebugHeapAllocate(heap, 128, 4));
+        DebugHeapGetStats(heap, &stats);
+        printf("%u hits, %u misses\n", stats.m_ReadyHits, stats.m_ReadyMisses);
+        Expect(stats.m_ReadyHits + stats.m_ReadyMisses == 1000, "every allocation is a hit or a miss");
+        Expect(stats.m_ReadyMisses > 0, "the first allocation misses");
+        Expect(stats.m_ReadyHits > 0, "repeated allocations hit");
+      }
+      break;
+
+    case 20:
+      {
+        DebugHeapSamplerConfig sampler_config = { 0 };
+        DebugHeapSamplerStats stats;
+        DebugHeapSampler* sampler;
+        unsigned int owned = 0;
+        int i;
+        sampler_config.m_Heap = heap;
+        sampler_config.m_Backing.m_Allocate = BackingAllocate;
+        sampler_config.m_Backing.m_Free = BackingFree;
+        sampler_config.m_Interval = 4;
+        sampler = DebugHeapSamplerCreate(&sampler_config);
+        // Frees go to whichever allocator the pointer came from.
+        for (i = 0; i < 1000; ++i) {
+          char* ptr = DebugHeapSamplerAllocate(sampler, 64, 4);
+          ptr[63] = 'a';
+          owned += DebugHeapOwns(heap, ptr) ? 1 : 0;
+          DebugHeapSamplerFree(sampler, ptr);
+        }
+        DebugHeapSamplerGetStats(sampler, &stats);
+        printf("%u sampled, %u from the backing allocator\n", stats.m_SampledAllocs, stats.m_BackingAllocs);
+        Expect(owned > 0 && owned < 1000, "some allocations, but not all, are sampled");
+        Expect(stats.m_SampledAllocs == owned && stats.m_BackingAllocs == 1000 - owned, "stats count both allocators");
+        DebugHeapSamplerDestroy(sampler);
+      }
+      break;
+
+    case 21:
+      {
+        static const char site_a = 'a', site_b = 'b';
+        DebugHeapSamplerConfig sampler_config = { 0 };
+        DebugHeapSampler* sampler;
+        DebugHeapSizeRange range;
+        char* ptrs[6];
+        int i;
+        sampler_config.m_Heap = heap;
+        sampler_config.m_Backing.m_Allocate = BackingAllocate;
+        sampler_config.m_Backing.m_Free = BackingFree;
+        sampler_config.m_Interval = 0; // only routed allocations
+        sampler = DebugHeapSamplerCreate(&sampler_config);
+        ptrs[0] = DebugHeapSamplerAllocateFrom(sampler, 64, 4, &site_a);
+        Expect(DebugHeapSamplerAddCallsite(sampler, &site_a), "a callsite is added");
+        ptrs[1] = DebugHeapSamplerAllocateFrom(sampler, 64, 4, &site_a);
+        ptrs[2] = DebugHeapSamplerAllocateFrom(sampler, 64, 4, &site_b);
+        DebugHeapSamplerRemoveCallsite(sampler, &site_a);
+        ptrs[3] = DebugHeapSamplerAllocateFrom(sampler, 64, 4, &site_a);
+        // Removing a callsite gives its room in the set back.
+        Expect(DebugHeapSamplerAddCallsite(sampler, &site_a), "a removed callsite is added again");
+        ptrs[4] = DebugHeapSamplerAllocateFrom(sampler, 64, 4, &site_a);
+        range.m_Min = 200;
+        range.m_Max = 300;
+        DebugHeapSamplerSetSizeRanges(sampler, &range, 1);
+        ptrs[5] = DebugHeapSamplerAllocateFrom(sampler, 250, 4, &site_b);
+        Expect(!DebugHeapOwns(heap, ptrs[0]), "unrouted callsites use the backing allocator");
+        Expect(DebugHeapOwns(heap, ptrs[1]), "an added callsite is routed to the heap");
+        Expect(!DebugHeapOwns(heap, ptrs[2]), "other callsites are not");
+        Expect(!DebugHeapOwns(heap, ptrs[3]), "a removed callsite is not routed");
+        Expect(DebugHeapOwns(heap, ptrs[4]), "a re-added callsite is routed again");
+        Expect(DebugHeapOwns(heap, ptrs[5]), "sizes in a routed range are routed");
+        for (i = 0; i < 6; ++i)
+          DebugHeapSamplerFree(sampler, ptrs[i]);
+        DebugHeapSamplerDestroy(sampler);
+      }
+      break;
+
+    case 22:
+      {
+        unsigned char* ptr;
+        ptr = DebugHeapAllocate(heap, 128, 4);
+        Expect(0xfc == ptr[-1] && 0xfc == ptr[-64], "the window in front of the allocation is filled");
+        Expect(0xfc != ptr[-65], "bytes before the window are not");
+        // Underruns past the window go unnoticed.
+        ptr[-65] = 'a';
+        DebugHeapFree(heap, ptr);
+      }
+      break;
+
     default:
       fprintf(stderr, "Unsupported test case\n");
       break;
   }
 
   DebugHeapDestroy(heap);
+  if (vm)
+    DebugHeapSimulatedVmDestroy(vm);
   
-  return 0;
+  return s_Failures ? 1 : 0;
 }
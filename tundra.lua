@@ -26,6 +26,9 @@ Build {
         "DebugHeap.c",
         "demo.c",
       },
+      Libs = {
+        { "pthread"; Config = "linux-*" },
+      },
     }
 
     Default(demo)